@@ -7,9 +7,13 @@
 #include "firefly/intel64/gdt/gdt.hpp"
 #include "firefly/intel64/gdt/tss.hpp"
 #include "firefly/intel64/int/interrupt.hpp"
+#include "firefly/intel64/paging.hpp"
 #include "firefly/kernel.hpp"
+#include "firefly/memory-manager/bench.hpp"
 #include "firefly/memory-manager/primary/primary_phys.hpp"
+#include "firefly/memory-manager/secondary/slab/slab.hpp"
 #include "firefly/memory-manager/virtual/virtual.hpp"
+#include "firefly/memory-manager/virtual/vmalloc.hpp"
 #include "firefly/panic.hpp"
 #include "firefly/stivale2.hpp"
 
@@ -112,9 +116,20 @@ void bootloader_services_init(stivale2_struct* handover) {
     if (tagmem == NULL) {
         firefly::panic("Cannot obtain memory map");
     }
-	core::paging::boot_map_extra_region(tagmem);
-    mm::Physical::init(tagmem);
+    mm::kernelPageSpace::record_memory_map(tagmem);
+    core::paging::init_early_allocator(tagmem);
+    mm::Physical::init(tagmem, core::paging::early_allocator_range());
+    core::paging::release_early_allocator();
+
+    // Nothing runs deferred work yet (there is no scheduler and no idle task), the pool is filled once for the
+    // zeroed allocations of the rest of the boot.
+    mm::Physical::refill_zero_pool();
+    mm::slab::init();
     mm::kernelPageSpace::init();
+    mm::init_vmalloc();
+
+    if constexpr (mm::bench::enabled)
+        mm::bench::run();
 }
 
 extern "C" [[noreturn]] void kernel_init(stivale2_struct* handover) {
@@ -90,7 +90,7 @@ assign_cpu_exceptions:
     %assign i i+1
     %endrep
 
-    %rep 6
+    %rep 7
         register_handler CPU_INTR_ERR%+i
     %assign i i+1
     %endrep
@@ -111,5 +111,6 @@ interrupt_wrapper:
     call interrupt_handler
 
     popa64
-	add rsp, 16
+    ; The stub's return address, the vector and the error code
+    add rsp, 24
     iretq
@@ -1,4 +1,6 @@
+#include "firefly/intel64/cpu.hpp"
 #include "firefly/logger.hpp"
+#include "firefly/memory-manager/virtual/page_fault.hpp"
 #include "firefly/trace/symbols.hpp"
 
 namespace firefly::kernel::core::interrupt {
@@ -14,6 +16,7 @@ struct __attribute__((packed)) idt_gate {
 
 static_assert(16 == sizeof(idt_gate), "idt_gate size incorrect");
 
+// Stack layout built by interrupt.asm. rbp isn't saved, it's callee-saved anyway.
 struct __attribute__((packed)) iframe {
     int64_t r15;
     int64_t r14;
@@ -23,13 +26,13 @@ struct __attribute__((packed)) iframe {
     int64_t r10;
     int64_t r9;
     int64_t r8;
-    int64_t rsi;
     int64_t rdi;
-    int64_t rbp;
+    int64_t rsi;
     int64_t rdx;
     int64_t rcx;
     int64_t rbx;
     int64_t rax;
+    int64_t stub_return;  // Pushed by the call into interrupt_wrapper
     int64_t int_no;
     int64_t err;
     int64_t rip;
@@ -83,9 +86,20 @@ void init() {
         : "memory");
 }
 
+static constexpr int64_t page_fault = 14;
+
 void interrupt_handler(iframe iframe) {
+    // Resolved page faults return, the faulting instruction is executed again.
+    const auto cr2 = iframe.int_no == page_fault ? core::cpu::read_cr2() : 0;
+    if (iframe.int_no == page_fault && mm::handle_page_fault(cr2, iframe.err))
+        return;
+
     info_logger << "Int#: " << iframe.int_no << "\nError code: " << iframe.err << logger::endl;
     info_logger << "RIP: " << info_logger.hex(iframe.rip) << logger::endl;
+    if (iframe.int_no == page_fault) {
+        info_logger << "CR2: " << info_logger.hex(cr2) << logger::endl;
+        mm::dump_page_fault_stats();
+    }
     backtrace(iframe.rip);
 
     for (;;)
@@ -1,15 +1,22 @@
 #include "firefly/intel64/paging.hpp"
 
 #include "firefly/compiler/clang++.hpp"
+#include "firefly/intel64/cpu.hpp"
+#include "firefly/logger.hpp"
+#include "firefly/memory-manager/hhdm.hpp"
 #include "firefly/memory-manager/primary/page_frame.hpp"
 #include "firefly/memory-manager/primary/primary_phys.hpp"
+#include "firefly/memory-manager/secondary/slab/object_cache.hpp"
 #include "firefly/panic.hpp"
 #include "libk++/align.h"
+#include "libk++/bits.h"
 
 namespace firefly::kernel::core::paging {
+using mm::phys_to_virt;
+using mm::virt_to_phys;
 
 void invalidatePage(const VirtualAddress page) {
-    asm volatile("invlpg %0" ::"m"(page)
+    asm volatile("invlpg (%0)" ::"r"(page)
                  : "memory");
 }
 
@@ -25,56 +32,495 @@ inline int64_t get_index(const uint64_t virtual_addr, const int idx) {
 mm::PageFrame pageAllocator{};
 bool early{ true };
 
-inline uint64_t *allocatePageTable(uint64_t size = PAGE_SIZE) {
+static constexpr uint64_t present = 1;
+static constexpr uint64_t page_size_bit = 1 << 7;  // Set in PD and PDPT entries which map a page instead of a table
+static constexpr uint64_t global_bit = static_cast<uint64_t>(AccessFlags::Global);
+static constexpr uint64_t address_mask = 0x000FFFFFFFFFF000;
+
+static uint64_t page_tables_allocated{};
+
+// See set_flush_threshold(), 32 pages is where flushing everything tends to become cheaper on current cores.
+static uint64_t threshold{ 32 };
+
+struct alignas(PAGE_SIZE) PageTable {
+    uint64_t entries[512]{};
+};
+
+// Page tables are cached in their constructed (zeroed) state: A table is cleared once when its slab is created,
+// and tables going back to the cache must be empty again, so handing one out never clears 4KiB.
+// Slabs hold several tables, mapping a range usually needs a few of them in a row.
+static constinit mm::ObjectCache<PageTable> page_tables{ "page-table" };
+
+inline uint64_t *allocatePageTable() {
     uint64_t *ptr{ nullptr };
 
-    if (likely(!early))
-        ptr = reinterpret_cast<uint64_t *>(mm::Physical::allocate(size));
-    else
-        ptr = reinterpret_cast<uint64_t *>(pageAllocator.allocate());
+    if (likely(!early)) {
+        if (auto table = page_tables.allocate())
+            ptr = table->entries;
+    } else if (auto page = pageAllocator.allocate()) {
+        ptr = phys_to_virt<uint64_t>(reinterpret_cast<uint64_t>(page));
+    }
 
     if (!ptr)
         firefly::panic("Unable to allocate memory for a page-table");
 
+    page_tables_allocated++;
     return ptr;
 }
 
-void traverse_page_tables(const uint64_t virtual_addr, const uint64_t physical_addr, const int access_flags, uint64_t *pml_ptr) {
-    auto idx4 = get_index(virtual_addr, 4);
-    auto idx3 = get_index(virtual_addr, 3);
-    auto idx2 = get_index(virtual_addr, 2);
-    auto idx1 = get_index(virtual_addr, 1);
+static inline uint64_t read_cr3() {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0"
+                 : "=r"(cr3));
+    return cr3;
+}
+
+// Reloading CR3 flushes every non-global TLB entry (of the current PCID).
+static inline void flush_tlb() {
+    asm volatile("mov %0, %%cr3" ::"r"(read_cr3())
+                 : "memory");
+}
+
+static constexpr uint64_t cr4_pge = 1 << 7;
+static constexpr uint64_t cr4_pcide = 1 << 17;
+static constexpr uint64_t cr3_no_flush = 1ull << 63;  // Keep the TLB entries of the PCID that is loaded
+static constexpr uint16_t max_pcid = 4095;
+
+static inline uint64_t read_cr4() {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0"
+                 : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" ::"r"(cr4)
+                 : "memory");
+}
+
+enum class InvpcidType : uint64_t {
+    Address = 0,     // One address of one PCID
+    Context = 1,     // Everything of one PCID, except global entries
+    AllGlobal = 2,   // Everything, including global entries
+};
+
+static inline void invpcid(InvpcidType type, uint16_t pcid, uint64_t address = 0) {
+    struct {
+        uint64_t pcid;
+        uint64_t address;
+    } descriptor{ pcid, address };
+
+    asm volatile("invpcid %0, %1" ::"m"(descriptor), "r"(static_cast<uint64_t>(type))
+                 : "memory");
+}
+
+static bool pcid_enabled{};
+static bool has_invpcid{};
+static uint64_t pcid_generation{ 1 };
+static uint16_t next_pcid{ 1 };
+
+bool pcid_supported() {
+    return cpu::cpuid(1).ecx & (1u << 17);
+}
+
+bool invpcid_supported() {
+    return cpu::cpuid(0).eax >= 7 && (cpu::cpuid(7).ebx & (1u << 10));
+}
+
+void flush_all_contexts() {
+    if (has_invpcid) {
+        invpcid(InvpcidType::AllGlobal, 0);
+        return;
+    }
+
+    // Any change to CR4.PGE flushes everything.
+    const auto cr4 = read_cr4();
+    write_cr4(cr4 ^ cr4_pge);
+    write_cr4(cr4);
+}
+
+void init_global_pages() {
+    // Clearing PGE first drops global entries the bootloader's page tables may have left behind.
+    const auto cr4 = read_cr4();
+    write_cr4(cr4 & ~cr4_pge);
+    write_cr4(cr4 | cr4_pge);
+}
+
+void init_pcid() {
+    if (!pcid_supported())
+        return;
+
+    // CR4.PCIDE can only be set while PCID 0 is loaded, which is the case for the kernel address space.
+    write_cr4(read_cr4() | cr4_pcide);
+    pcid_enabled = true;
+    has_invpcid = invpcid_supported();
+
+    info_logger << info_logger.format("paging: PCIDs enabled (INVPCID: %s)\n", has_invpcid ? "yes" : "no");
+}
+
+static inline bool pcid_valid(const Pcid &pcid) {
+    return pcid.generation == pcid_generation || pcid.generation == Pcid::pinned;
+}
+
+void load_address_space(const uint64_t *pml_ptr, Pcid &pcid) {
+    auto cr3 = virt_to_phys(pml_ptr);
+
+    if (pcid_enabled) {
+        if (pcid_valid(pcid)) {
+            cr3 |= pcid.id | cr3_no_flush;
+        } else {
+            // Start a new generation once every identifier has been handed out.
+            // Flushing everything ensures that no identifier of the new generation has stale TLB entries.
+            if (next_pcid > max_pcid) {
+                flush_all_contexts();
+                pcid_generation++;
+                next_pcid = 1;
+            }
+
+            pcid = { .id = next_pcid++, .generation = pcid_generation };
+            cr3 |= pcid.id;
+        }
+    }
+
+    asm volatile("mov %0, %%cr3" ::"r"(cr3)
+                 : "memory");
+}
+
+// Number of address bits a table at 'level' covers.
+static constexpr int coverage_shift(int level) {
+    return PAGE_SHIFT + 9 * level;
+}
+
+Cursor::Cursor(const uint64_t *pml_ptr, Pcid *pcid)
+    : pml4(const_cast<uint64_t *>(pml_ptr)), pcid(pcid), target(Target::None) {
+    if ((read_cr3() & address_mask) == virt_to_phys(pml_ptr))
+        target = Target::Loaded;
+    else if (pcid_enabled && pcid && pcid_valid(*pcid))
+        target = Target::Tagged;
+}
+
+Cursor::~Cursor() {
+    flush();
+}
+
+uint64_t *Cursor::table(uint64_t virtual_addr, int level, uint64_t create_flags) {
+    // Start from the lowest remembered table that still covers the address.
+    int from = 4;
+    uint64_t *table = pml4;
+    for (int i = level; i < 4; i++) {
+        if (tables[i] && prefixes[i] == virtual_addr >> coverage_shift(i)) {
+            from = i;
+            table = tables[i];
+            break;
+        }
+    }
+
+    for (int idx = from; idx > level; idx--) {
+        auto &entry = table[get_index(virtual_addr, idx)];
+
+        if (!(entry & present)) {
+            if (!create_flags)
+                return nullptr;
+
+            entry = virt_to_phys(allocatePageTable()) | create_flags;
+        } else if (unlikely(entry & page_size_bit)) {
+            if (!create_flags)
+                return nullptr;
+
+            firefly::panic("Cannot map a page into a range covered by a large page");
+        }
+
+        table = phys_to_virt<uint64_t>(entry & address_mask);
+        tables[idx - 1] = table;
+        prefixes[idx - 1] = virtual_addr >> coverage_shift(idx - 1);
+    }
+
+    return table;
+}
+
+void Cursor::map(uint64_t virtual_addr, uint64_t physical_addr, AccessFlags access_flags, PageSize size) {
+    const int level = size == PageSize::Huge ? 3 : (size == PageSize::Large ? 2 : 1);
+    const auto flags = static_cast<uint64_t>(access_flags) | (level > 1 ? page_size_bit : 0);
+
+    // Tables are always writable, access is restricted by the leaf entries. (User access has to be allowed at every level)
+    // The global bit only means something in leaf entries.
+    const auto table_flags = (static_cast<uint64_t>(access_flags) & ~global_bit) | static_cast<uint64_t>(AccessFlags::ReadWrite);
+    auto &entry = table(virtual_addr, level, table_flags)[get_index(virtual_addr, level)];
+
+    // The table would be lost (and stay in the paging-structure caches) if it was simply overwritten.
+    if (level > 1 && (entry & present) && !(entry & page_size_bit)) {
+        release_subtree(virtual_addr, level - 1);
+        flush_all = true;
+    }
+
+    const auto old = entry;
+    entry = physical_addr | flags;
+
+    // A non-present entry can't be cached by the TLB.
+    if (old & present)
+        invalidate(virtual_addr, old & global_bit);
+}
+
+uint64_t *Cursor::leaf(uint64_t virtual_addr, uint64_t &size) {
+    // Walk down until a large page or a PT entry is found.
+    for (int level = 3; level >= 1; level--) {
+        auto parent = table(virtual_addr, level, 0);
+        if (parent == nullptr) {
+            size = 1ull << coverage_shift(level);
+            return nullptr;
+        }
+
+        size = 1ull << coverage_shift(level - 1);
+        auto &entry = parent[get_index(virtual_addr, level)];
+        if (!(entry & present))
+            return nullptr;
+
+        if (level == 1 || (entry & page_size_bit))
+            return &entry;
+    }
+
+    return nullptr;
+}
+
+void Cursor::release_table(uint64_t virtual_addr, int level) {
+    auto parent = table(virtual_addr, level + 1, 0);
+    if (parent == nullptr)
+        return;
+
+    auto &entry = parent[get_index(virtual_addr, level + 1)];
+    if (!(entry & present) || (entry & page_size_bit))
+        return;
+
+    auto released_table = phys_to_virt<uint64_t>(entry & address_mask);
+    entry = 0;
+    // Kernel-half tables may still be cached for other PCIDs, invalidate() flushes all of them for those.
+    invalidate(virtual_addr);
+
+    // Forget the table and everything below it.
+    for (int i = 1; i <= level; i++)
+        tables[i] = nullptr;
+
+    if (num_released == max_released)
+        flush();
+    released[num_released++] = released_table;
+}
+
+void Cursor::release_subtree(uint64_t virtual_addr, int level) {
+    auto released_table = table(virtual_addr, level, 0);
+
+    for (uint64_t i = 0; i < 512; i++) {
+        if (!(released_table[i] & present))
+            continue;
+
+        if (level == 1 || (released_table[i] & page_size_bit))
+            firefly::panic("Cursor::map(): Cannot map a large page over smaller pages");
+
+        release_subtree(virtual_addr + (i << coverage_shift(level - 1)), level - 1);
+    }
+
+    release_table(virtual_addr, level);
+}
+
+void Cursor::invalidate(uint64_t virtual_addr, bool global_entry) {
+    // A non-global kernel-half entry may be cached under every PCID, not only the current or tagged one.
+    if (pcid_enabled && virtual_addr >= AddressLayout::High && !global_entry) {
+        global = true;
+        flush_all = true;
+        return;
+    }
+
+    if (target == Target::None && !global_entry)
+        return;
+
+    global |= global_entry;
+    if (flush_all)
+        return;
+
+    // Without INVPCID the PCID is dropped instead, see flush().
+    if (target == Target::Tagged && !has_invpcid) {
+        flush_all = true;
+        return;
+    }
+
+    if (num_pending == threshold) {
+        flush_all = true;
+        return;
+    }
+
+    pending[num_pending++] = virtual_addr;
+}
+
+bool Cursor::clear(uint64_t virtual_addr, uint64_t &physical_addr) {
+    uint64_t size;
+    auto entry = leaf(virtual_addr, size);
+    if (entry == nullptr)
+        return false;
+
+    if (unlikely(size != PAGE_SIZE))
+        firefly::panic("Cursor::clear(): Cannot clear part of a large page");
+
+    physical_addr = *entry & address_mask;
+    *entry = 0;
+    return true;
+}
+
+void Cursor::flush() {
+    // Global entries are dropped for every PCID by invlpg, whichever address space is loaded.
+    // Flushing them all takes a full flush, which also covers everything below.
+    if (global) {
+        if (flush_all)
+            flush_all_contexts();
+        else
+            for (uint64_t i = 0; i < num_pending; i++)
+                invalidatePage(pending[i]);
+    }
+
+    if (global && flush_all) {
+        // Done
+    } else if (target == Target::Loaded && !global) {
+        if (flush_all)
+            flush_tlb();
+        else
+            for (uint64_t i = 0; i < num_pending; i++)
+                invalidatePage(pending[i]);
+    } else if (target == Target::Tagged && has_invpcid) {
+        if (flush_all)
+            invpcid(InvpcidType::Context, pcid->id);
+        else
+            for (uint64_t i = 0; i < num_pending; i++)
+                invpcid(InvpcidType::Address, pcid->id, pending[i]);
+    } else if (target == Target::Tagged && flush_all) {
+        // The address space gets a fresh PCID (and with it an empty TLB) the next time it is loaded.
+        if (pcid->generation == Pcid::pinned)
+            flush_all_contexts();
+        else
+            pcid->generation = 0;
+
+        target = Target::None;
+    }
+
+    num_pending = 0;
+    flush_all = false;
+    global = false;
+
+    // No stale TLB or paging-structure cache entry can point into the released tables anymore.
+    // Tables are handed back in their constructed state, all of their entries were cleared before they were released.
+    for (int i = 0; i < num_released; i++) {
+        if (pagelist.virt_to_page(released[i])->flags == RawPageFlags::ObjectSlab)
+            page_tables.deallocate(reinterpret_cast<PageTable *>(released[i]));
+
+        page_tables_allocated--;
+    }
+    num_released = 0;
+}
+
+void map(uint64_t virtual_addr, uint64_t physical_addr, AccessFlags access_flags, const uint64_t *pml_ptr, PageSize size, Pcid *pcid) {
+    Cursor cursor(pml_ptr, pcid);
+    cursor.map(virtual_addr, physical_addr, access_flags, size);
+}
+
+bool huge_pages_supported() {
+    static int supported = -1;
 
-    if (!(pml_ptr[idx4] & 1)) {
-        uint64_t *ptr = allocatePageTable();
-        pml_ptr[idx4] = reinterpret_cast<uint64_t>(ptr);
-        pml_ptr[idx4] |= access_flags;
+    if (unlikely(supported < 0)) {
+        const auto max_extended_leaf = cpu::cpuid(0x80000000).eax;
+        supported = max_extended_leaf >= 0x80000001 && (cpu::cpuid(0x80000001).edx & (1u << 26));
     }
-    auto pml3 = reinterpret_cast<uint64_t *>(pml_ptr[idx4] & ~(511));
 
-    if (!(pml3[idx3] & 1)) {
-        const auto ptr = allocatePageTable();
-        pml3[idx3] = reinterpret_cast<uint64_t>(ptr);
-        pml3[idx3] |= access_flags;
+    return supported;
+}
+
+void map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t length, AccessFlags access_flags, const uint64_t *pml_ptr, Pcid *pcid) {
+    const bool huge = huge_pages_supported();
+    Cursor cursor(pml_ptr, pcid);
+
+    auto fits = [&](uint64_t offset, PageSize size) {
+        const auto bytes = static_cast<uint64_t>(size);
+        return ((virtual_addr + offset) & (bytes - 1)) == 0 && ((physical_addr + offset) & (bytes - 1)) == 0 && length - offset >= bytes;
+    };
+
+    for (uint64_t offset = 0; offset < length;) {
+        auto size = PageSize::Small;
+        if (huge && fits(offset, PageSize::Huge))
+            size = PageSize::Huge;
+        else if (fits(offset, PageSize::Large))
+            size = PageSize::Large;
+
+        cursor.map(virtual_addr + offset, physical_addr + offset, access_flags, size);
+        offset += static_cast<uint64_t>(size);
     }
-    auto pml2 = reinterpret_cast<uint64_t *>(pml3[idx3] & ~(511));
+}
+
+void protect_range(uint64_t virtual_addr, uint64_t length, AccessFlags access_flags, const uint64_t *pml_ptr, Pcid *pcid) {
+    constexpr uint64_t access_mask = static_cast<uint64_t>(AccessFlags::UserReadWrite | AccessFlags::Global);
+    Cursor cursor(pml_ptr, pcid);
+
+    for (uint64_t addr = virtual_addr & ~(PAGE_SIZE - 1ull), end = virtual_addr + length; addr < end;) {
+        uint64_t size;
+        auto entry = cursor.leaf(addr, size);
 
-    if ((pml2[idx2] & 1) == 0) {
-        const auto ptr = allocatePageTable();
-        pml2[idx2] = reinterpret_cast<uint64_t>(ptr);
-        pml2[idx2] |= access_flags;
+        if (entry) {
+            const bool global = *entry & global_bit;
+            *entry = (*entry & ~access_mask) | static_cast<uint64_t>(access_flags);
+            cursor.invalidate(addr, global);
+        }
+
+        addr = (addr & ~(size - 1)) + size;
     }
+}
 
-    const auto pml1 = reinterpret_cast<uint64_t *>(pml2[idx2] & ~(511));
-    pml1[idx1] = (physical_addr | access_flags);
+void unmap(uint64_t virtual_addr, const uint64_t *pml_ptr, Pcid *pcid) {
+    unmap_range(virtual_addr, PAGE_SIZE, pml_ptr, pcid);
 }
 
-void map(uint64_t virtual_addr, uint64_t physical_addr, AccessFlags access_flags, const uint64_t *pml_ptr) {
-    traverse_page_tables(virtual_addr, physical_addr, static_cast<const int>(access_flags), const_cast<uint64_t *>(pml_ptr));
-    invalidatePage(reinterpret_cast<VirtualAddress>(virtual_addr));
+void unmap_range(uint64_t virtual_addr, uint64_t length, const uint64_t *pml_ptr, Pcid *pcid) {
+    const uint64_t start = virtual_addr & ~(PAGE_SIZE - 1ull), end = virtual_addr + length;
+    Cursor cursor(pml_ptr, pcid);
+
+    for (uint64_t addr = start; addr < end;) {
+        uint64_t size;
+        auto entry = cursor.leaf(addr, size);
+        const auto next = (addr & ~(size - 1)) + size;
+
+        if (entry) {
+            if (unlikely((addr & (size - 1)) || next > end))
+                firefly::panic("unmap_range(): Cannot unmap part of a large page");
+
+            const bool global = *entry & global_bit;
+            *entry = 0;
+            cursor.invalidate(addr, global);
+        }
+
+        // Tables (PT, PD and PDPT) whose whole coverage lies in the range are empty now.
+        // Every address space copies the kernel half of the PML4, its PDPTs stay populated for good.
+        for (int level = 1; level <= 3; level++) {
+            const auto coverage = 1ull << coverage_shift(level);
+            if (next % coverage != 0 || next - coverage < start || next > end)
+                break;
+
+            if (level == 3 && next - coverage >= AddressLayout::High)
+                break;
+
+            cursor.release_table(next - coverage, level);
+        }
+
+        addr = next;
+    }
+}
+
+void set_flush_threshold(uint64_t pages) {
+    threshold = pages < max_flush_threshold ? pages : max_flush_threshold;
+}
+
+uint64_t flush_threshold() {
+    return threshold;
+}
+
+uint64_t page_table_count() {
+    return page_tables_allocated;
 }
 
-void boot_map_extra_region(stivale2_struct_tag_memmap *mmap) {
+void init_early_allocator(stivale2_struct_tag_memmap *mmap) {
     constexpr int required_size = 4;
 
     for (uint64_t i = 0; i < mmap->entries; i++) {
@@ -82,20 +528,32 @@ void boot_map_extra_region(stivale2_struct_tag_memmap *mmap) {
         if (e->type != STIVALE2_MMAP_USABLE || e->length < MiB(required_size))
             continue;
 
+        static_assert(MiB(required_size) / PAGE_SIZE <= mm::PageFrame::max_pages);
         pageAllocator.init(PhysicalAddress(e->base), MiB(required_size));
         e->base = libkern::align_up4k(e->base + MiB(required_size));
         e->length -= libkern::align_down4k(MiB(required_size));
         break;
     }
+}
 
-    auto cr3{ 0ul };
-    asm volatile("mov %%cr3, %0"
-                 : "=r"(cr3)::);
-
-    for (uint32_t i = 0; i < GiB(1); i += PAGE_SIZE)
-        map(i + AddressLayout::PageData, i, AccessFlags::ReadWrite, reinterpret_cast<const uint64_t *>(cr3));
+PhysicalRange early_allocator_range() {
+    return pageAllocator.range();
+}
 
+void release_early_allocator() {
     early = false;
+
+    // Page tables taken from the early allocator stay in use, the rest of its region goes to the buddy allocators.
+    pageAllocator.release([](uint64_t base, uint64_t length) {
+        mm::Physical::free_range(base, length);
+    });
+}
+
+void boot_map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t length) {
+    Cursor cursor(phys_to_virt<const uint64_t>(read_cr3() & address_mask));
+
+    for (uint64_t i = 0; i < length; i += PAGE_SIZE)
+        cursor.map(virtual_addr + i, physical_addr + i, AccessFlags::ReadWrite);
 }
 
 }  // namespace firefly::kernel::core::paging
\ No newline at end of file
@@ -0,0 +1,277 @@
+#include "firefly/memory-manager/bench.hpp"
+
+#include "firefly/intel64/cpu.hpp"
+#include "firefly/intel64/paging.hpp"
+#include "firefly/logger.hpp"
+#include "firefly/memory-manager/hhdm.hpp"
+#include "firefly/memory-manager/primary/primary_phys.hpp"
+#include "firefly/memory-manager/virtual/page_fault.hpp"
+#include "firefly/memory-manager/virtual/virtual.hpp"
+#include "firefly/memory-manager/virtual/vmalloc.hpp"
+#include "firefly/panic.hpp"
+#include "libk++/bits.h"
+
+namespace firefly::kernel::mm::bench {
+using core::cpu::rdtsc;
+
+static constexpr int num_pages = 4096;
+static PhysicalAddress pages[num_pages];
+
+// Allocate a batch of 4KiB pages and free every other one first so that none of
+// them can be merged. The second pass frees their buddies which makes every free coalesce.
+// The per-CPU page caches would absorb the frees, the buddy allocators are used directly.
+static void scattered_page_free() {
+    int allocated = 0;
+    for (; allocated < num_pages; allocated++) {
+        pages[allocated] = Physical::allocate_uncached(PAGE_SIZE);
+        if (!pages[allocated])
+            break;
+    }
+
+    const uint64_t odd = allocated / 2, even = allocated - odd;
+    if (odd == 0)
+        return;
+
+    auto start = rdtsc();
+    for (int i = 1; i < allocated; i += 2)
+        Physical::deallocate_uncached(pages[i]);
+    auto scattered = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < allocated; i += 2)
+        Physical::deallocate_uncached(pages[i]);
+    auto merging = rdtsc() - start;
+
+    info_logger << info_logger.format("bench: scattered free of %d pages: %d cycles/free (no merge), %d cycles/free (merging)\n",
+                                      odd + even, scattered / odd, merging / even);
+}
+
+// The same number of pages allocated and freed one at a time and in a single batch.
+static void bulk_vs_single() {
+    int allocated = 0;
+
+    auto start = rdtsc();
+    for (; allocated < num_pages; allocated++) {
+        pages[allocated] = Physical::allocate(PAGE_SIZE, FillMode::NONE);
+        if (!pages[allocated])
+            break;
+    }
+    auto single_alloc = rdtsc() - start;
+
+    start = rdtsc();
+    for (int i = 0; i < allocated; i++)
+        Physical::deallocate(pages[i]);
+    auto single_free = rdtsc() - start;
+
+    start = rdtsc();
+    const uint64_t bulk = Physical::allocate_bulk(pages, allocated, PAGE_SIZE, FillMode::NONE);
+    auto bulk_alloc = rdtsc() - start;
+
+    start = rdtsc();
+    Physical::deallocate_bulk(pages, bulk);
+    auto bulk_free = rdtsc() - start;
+
+    if (allocated == 0 || bulk == 0)
+        return;
+
+    info_logger << info_logger.format("bench: %d pages one by one: %d cycles/alloc, %d cycles/free\n",
+                                      uint64_t(allocated), single_alloc / allocated, single_free / allocated);
+    info_logger << info_logger.format("bench: %d pages in bulk: %d cycles/alloc, %d cycles/free\n",
+                                      bulk, bulk_alloc / bulk, bulk_free / bulk);
+}
+
+// Working set for the TLB benches. The direct map and vmalloc() are mapped global, their translations survive CR3 writes
+// and flushes of single contexts. The working set gets a second mapping without the global bit instead.
+static uint64_t map_working_set(PhysicalAddress frames, uint64_t pages) {
+    const auto base = vm_reserve(pages * PAGE_SIZE);
+    if (base)
+        kernelPageSpace::accessor().mapRangeAt(base, virt_to_phys(frames), pages * PAGE_SIZE, AccessFlags::ReadWrite);
+
+    return base;
+}
+
+static void unmap_working_set(uint64_t base, uint64_t pages) {
+    kernelPageSpace::accessor().unmapRange(base, pages * PAGE_SIZE);
+    vm_release(base);
+}
+
+// Unmap ranges of increasing size once with invlpg per page and once with a full TLB flush.
+// A full flush also throws out the translations of everything else, so a working set of unrelated pages is touched
+// after each unmap and counted as part of its cost. The crossover is where the full flush starts winning.
+static void unmap_flush_crossover() {
+    constexpr uint64_t max_pages = core::paging::max_flush_threshold;
+    constexpr uint64_t working_set = 64, rounds = 16;
+
+    auto &space = kernelPageSpace::accessor();
+    const auto scratch = vm_reserve(max_pages * PAGE_SIZE);
+    auto frames = static_cast<uint8_t *>(Physical::allocate(max_pages * PAGE_SIZE, FillMode::NONE));
+    auto others_frames = Physical::allocate(working_set * PAGE_SIZE, FillMode::NONE);
+    const auto others_base = others_frames ? map_working_set(others_frames, working_set) : 0;
+    auto others = reinterpret_cast<volatile uint8_t *>(others_base);
+    if (!scratch || !frames || !others)
+        return;
+
+    auto touch_working_set = [&] {
+        for (uint64_t i = 0; i < working_set; i++)
+            (void)others[i * PAGE_SIZE];
+    };
+
+    const auto saved_threshold = core::paging::flush_threshold();
+
+    for (uint64_t pages = 1; pages <= max_pages; pages *= 2) {
+        uint64_t cycles[2]{};
+
+        for (int full_flush = 0; full_flush < 2; full_flush++) {
+            core::paging::set_flush_threshold(full_flush ? 0 : max_pages);
+
+            for (uint64_t round = 0; round < rounds; round++) {
+                space.mapRangeAt(scratch, virt_to_phys(frames), pages * PAGE_SIZE, AccessFlags::ReadWrite);
+                for (uint64_t i = 0; i < pages; i++)
+                    (void)*reinterpret_cast<volatile uint8_t *>(scratch + i * PAGE_SIZE);
+                touch_working_set();
+
+                const auto start = rdtsc();
+                space.unmapRange(scratch, pages * PAGE_SIZE);
+                touch_working_set();
+                cycles[full_flush] += rdtsc() - start;
+            }
+        }
+
+        info_logger << info_logger.format("bench: unmap %d pages: %d cycles with invlpg, %d cycles with a full flush\n",
+                                          pages, cycles[0] / rounds, cycles[1] / rounds);
+    }
+
+    core::paging::set_flush_threshold(saved_threshold);
+    vm_release(scratch);
+    unmap_working_set(others_base, working_set);
+    Physical::deallocate(frames);
+    Physical::deallocate(others_frames);
+}
+
+// Switch back and forth between the kernel address space and a copy of it, touching a working set after every switch.
+// Plain CR3 writes throw the TLB away each time, so every touch after a switch misses. PCID-tagged switches keep it.
+static void address_space_switch() {
+    constexpr uint64_t working_set = 64, rounds = 256;
+
+    if (!core::paging::pcid_supported()) {
+        info_logger << "bench: PCIDs not supported, skipping address space switches\n";
+        return;
+    }
+
+    auto &space = kernelPageSpace::accessor();
+    const auto kernel_pml4 = reinterpret_cast<const uint64_t *>(space.root());
+    auto copy_pml4 = static_cast<uint64_t *>(Physical::allocate(PAGE_SIZE, FillMode::NONE));
+    auto others_frames = Physical::allocate(working_set * PAGE_SIZE, FillMode::NONE);
+    const auto others_base = others_frames ? map_working_set(others_frames, working_set) : 0;
+    auto others = reinterpret_cast<volatile uint8_t *>(others_base);
+    if (!copy_pml4 || !others)
+        return;
+
+    // Sharing every PML4 entry makes both address spaces translate the working set (and this code) the same way.
+    for (int i = 0; i < 512; i++)
+        copy_pml4[i] = kernel_pml4[i];
+
+    auto touch_working_set = [&] {
+        for (uint64_t i = 0; i < working_set; i++)
+            (void)others[i * PAGE_SIZE];
+    };
+
+    auto plain_switch = [](const uint64_t *pml4) {
+        asm volatile("mov %0, %%cr3" ::"r"(virt_to_phys(pml4))
+                     : "memory");
+    };
+
+    auto kernel_pcid = core::paging::Pcid::kernel();
+    core::paging::Pcid copy_pcid{};
+    uint64_t cycles[2]{};
+
+    for (int tagged = 0; tagged < 2; tagged++) {
+        touch_working_set();
+
+        const auto start = rdtsc();
+        for (uint64_t round = 0; round < rounds; round++) {
+            if (tagged)
+                core::paging::load_address_space(copy_pml4, copy_pcid);
+            else
+                plain_switch(copy_pml4);
+            touch_working_set();
+
+            if (tagged)
+                core::paging::load_address_space(kernel_pml4, kernel_pcid);
+            else
+                plain_switch(kernel_pml4);
+            touch_working_set();
+        }
+        cycles[tagged] = rdtsc() - start;
+    }
+
+    info_logger << info_logger.format("bench: address space switch + %d page touches: %d cycles plain, %d cycles with PCIDs\n",
+                                      working_set, cycles[0] / (rounds * 2), cycles[1] / (rounds * 2));
+
+    space.loadAddressSpace();
+    unmap_working_set(others_base, working_set);
+    Physical::deallocate(copy_pml4);
+    Physical::deallocate(others_frames);
+}
+
+// Large buffers from the physical allocator need a contiguous block, vmalloc() assembles them from single pages.
+static void large_buffers() {
+    constexpr uint64_t size = MiB(4), count = 16;
+    void *buffers[count];
+    uint64_t cycles[2]{};
+
+    for (int virtually_contiguous = 0; virtually_contiguous < 2; virtually_contiguous++) {
+        const auto start = rdtsc();
+
+        for (uint64_t i = 0; i < count; i++)
+            buffers[i] = virtually_contiguous ? vmalloc(size) : Physical::allocate(size, FillMode::NONE);
+
+        for (uint64_t i = 0; i < count; i++) {
+            if (virtually_contiguous)
+                vfree(buffers[i]);
+            else
+                Physical::deallocate(buffers[i]);
+        }
+
+        cycles[virtually_contiguous] = rdtsc() - start;
+    }
+
+    const auto stats = vmalloc_stats();
+    info_logger << info_logger.format("bench: %d buffers of %d KiB: %d cycles/buffer physically contiguous, %d cycles/buffer with vmalloc (%d purges)\n",
+                                      count, size >> 10, cycles[0] / count, cycles[1] / count, stats.purges);
+}
+
+// A large reservation backed on demand only costs the pages that are touched, each of them one page fault.
+static void demand_paging() {
+    constexpr uint64_t size = MiB(64), stride = 16 * PAGE_SIZE;
+    auto area = static_cast<volatile uint8_t *>(vmalloc_lazy(size));
+    if (area == nullptr)
+        return;
+
+    const auto faults = page_fault_stats().minor_faults;
+    const auto start = rdtsc();
+    for (uint64_t offset = 0; offset < size; offset += stride)
+        area[offset] = 1;
+
+    const auto cycles = rdtsc() - start;
+    const auto touched = page_fault_stats().minor_faults - faults;
+    const auto mapped = vmalloc_stats().mapped_pages;
+    vfree(const_cast<uint8_t *>(area));
+
+    if (touched != size / stride)
+        firefly::panic("bench: Touching a vmalloc_lazy() area didn't fault its pages in");
+
+    info_logger << info_logger.format("bench: %d MiB reserved on demand, %d pages touched: %d faults, %d cycles/fault, %d pages mapped\n",
+                                      size >> 20, size / stride, touched, touched ? cycles / touched : 0, mapped);
+    dump_page_fault_stats();
+}
+
+void run() {
+    scattered_page_free();
+    bulk_vs_single();
+    unmap_flush_crossover();
+    address_space_switch();
+    large_buffers();
+    demand_paging();
+}
+}  // namespace firefly::kernel::mm::bench
@@ -0,0 +1,4 @@
+#include "firefly/memory-manager/page.hpp"
+
+// Defined on its own, the hosted tests build primary_phys.cpp around a pagelist of their own.
+Pagelist pagelist;
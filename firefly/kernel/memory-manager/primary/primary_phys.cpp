@@ -1,29 +1,369 @@
 #include "firefly/memory-manager/primary/primary_phys.hpp"
 
+#include "firefly/intel64/cpu.hpp"
+#include "firefly/intel64/paging.hpp"
 #include "firefly/memory-manager/page.hpp"
 #include "firefly/memory-manager/primary/buddy.hpp"
-
-Pagelist pagelist;
+#include "firefly/memory-manager/primary/page_cache.hpp"
+#include "firefly/memory-manager/primary/zero_pool.hpp"
+#include "firefly/memory-manager/shrinker.hpp"
 
 namespace firefly::kernel::mm::Physical {
 
 static BuddyManager buddy;
+static PageCache page_caches[core::cpu::max_cpus];
+static ZeroPool zero_pool;
+
+static_assert(stat_orders == BuddyAllocator::largest_allowed_order - BuddyAllocator::min_order + 1);
+
+// Measuring every call costs two serializing rdtsc reads, enable it for benchmarks only.
+// The histograms are shared by every CPU without synchronization, with several CPUs running their counts are approximate.
+static constexpr bool measure_latency{};
+static LatencyHistogram allocate_cycles, deallocate_cycles;
+static uint64_t failures;
+static bool initialized;
+
+// Set while free memory is below the low watermark, reclaim runs once when it drops below and again after it recovered.
+static bool below_low;
+
+// Zeroing the pooled pages was paid for already, they are only given up once an allocation failed and go last.
+// They are freed to the buddy allocators directly.
+class ZeroPoolShrinker final : public Shrinker {
+public:
+    constexpr ZeroPoolShrinker()
+        : Shrinker("zero-pool", 200, true) {
+    }
+
+    uint64_t count() const override {
+        return zero_pool.pages();
+    }
+
+    uint64_t scan(uint64_t pages) override {
+        return zero_pool.drain(pages, [](PhysicalAddress page) { buddy.free(static_cast<BuddyAllocator::AddressType>(page)); });
+    }
+};
+
+// Runs after the caches which free into it (i.e. slab pages go to the per-CPU caches).
+class PageCacheShrinker final : public Shrinker {
+public:
+    constexpr PageCacheShrinker()
+        : Shrinker("page-cache", 100) {
+    }
+
+    uint64_t count() const override {
+        return page_caches[core::cpu::id()].cached_pages();
+    }
+
+    // Todo: Only the cache of the calling CPU is drained, the others would have to drain their own once the APs are up.
+    uint64_t scan(uint64_t pages) override {
+        auto &cache = page_caches[core::cpu::id()];
+        uint64_t freed = 0;
+
+        for (int order = PageCache::max_order; order >= 0 && freed < pages; order--) {
+            const auto blocks = ((pages - freed) + (1ull << order) - 1) >> order;
+            freed += uint64_t(cache.drain(order, blocks > INT32_MAX ? INT32_MAX : blocks)) << order;
+        }
+
+        return freed;
+    }
+};
+
+static constinit ZeroPoolShrinker zero_pool_shrinker;
+static constinit PageCacheShrinker page_cache_shrinker;
 
-void init(stivale2_struct_tag_memmap *mmap) {
-    buddy.init(mmap);
-    pagelist.init(mmap);
+void init(stivale2_struct_tag_memmap *mmap, PhysicalRange early) {
+    // Nothing of an earlier init() may survive, the hosted tests boot the allocator repeatedly.
+    buddy = {};
+    zero_pool = {};
+    failures = 0;
+    below_low = false;
+
+    // The pagelist has to be set up first, the buddy allocators record their allocations in it.
+    pagelist.init(mmap, early);
+    pagelist.for_each_run([](uint64_t virt, uint64_t phys, uint64_t length) {
+        core::paging::boot_map_range(virt, phys, length);
+    });
+    pagelist.populate(mmap);
+
+    buddy.init(mmap, early);
+
+    for (auto &cache : page_caches)
+        cache.init(&buddy);
+
+    register_shrinker(zero_pool_shrinker);
+    register_shrinker(page_cache_shrinker);
+
+    initialized = true;
     info_logger << "pmm: Initialized" << logger::endl;
 }
 
+static PhysicalAddress allocate_block(uint64_t size, FillMode fill) {
+    const auto order = PageCache::order_of(size);
+    if (order > PageCache::max_order)
+        return buddy.alloc(size, fill);
+
+    if (order == 0 && fill == FillMode::ZERO) {
+        if (auto page = zero_pool.take())
+            return page;
+    }
+
+    auto ptr = page_caches[core::cpu::id()].alloc(order);
+    if (ptr && fill != FillMode::NONE)
+        memset(ptr, fill, PAGE_SIZE << order);
+
+    return ptr;
+}
+
+// Start reclaiming once free memory of all zones together drops below the low watermark.
+// A single small zone running dry doesn't count, the allocation is served by the others.
+static inline void check_watermarks() {
+    const auto free_pages = buddy.free_pages();
+    const auto &watermarks = buddy.watermarks();
+
+    // Only written when it changes, every CPU reads it on every allocation.
+    if (likely(free_pages >= watermarks.low)) {
+        if (unlikely(below_low))
+            below_low = false;
+        return;
+    }
+
+    if (below_low)
+        return;
+
+    below_low = true;
+    reclaim(watermarks.high - free_pages, ReclaimReason::LowWatermark);
+}
+
 PhysicalAddress allocate(uint64_t size, FillMode fill) {
-    return buddy.alloc(size, fill);
+    const auto start = measure_latency ? core::cpu::rdtsc() : 0;
+    auto ptr = allocate_block(size, fill);
+
+    // Out of memory (or too fragmented), give the caches a chance to free everything they can and try again.
+    if (unlikely(ptr == nullptr) && reclaim(~0ull))
+        ptr = allocate_block(size, fill);
+
+    if (likely(ptr != nullptr))
+        check_watermarks();
+
+    if constexpr (measure_latency)
+        allocate_cycles.record(core::cpu::rdtsc() - start);
+
+    if (unlikely(ptr == nullptr))
+        failures++;
+
+    return ptr;
 }
 
 PhysicalAddress must_allocate(uint64_t size, FillMode fill) {
-	return buddy.must_alloc(size, fill);
+    auto ptr = allocate(size, fill);
+    if (!ptr)
+        firefly::panic("must_allocate failed to allocate memory!");
+
+    return ptr;
+}
+
+// Page order of 'ptr' if it belongs into the CPU-local cache, -1 otherwise.
+static inline int cached_order(PhysicalAddress ptr) {
+    auto page = pagelist.virt_to_page(ptr);
+    const auto order = page->order - BuddyAllocator::min_order;
+
+    return page->is_buddy_page(BuddyAllocator::min_order) && order <= PageCache::max_order ? order : -1;
+}
+
+static void deallocate_block(PhysicalAddress ptr) {
+    // Low order blocks go back to the CPU-local cache, the buddy only sees them once the cache is drained.
+    if (const auto order = cached_order(ptr); order >= 0) {
+        page_caches[core::cpu::id()].free(ptr, order);
+        return;
+    }
+
+    buddy.free(static_cast<BuddyAllocator::AddressType>(ptr));
 }
 
 void deallocate(PhysicalAddress ptr) {
+    if (ptr == nullptr)
+        return;
+
+    const auto start = measure_latency ? core::cpu::rdtsc() : 0;
+    deallocate_block(ptr);
+
+    if constexpr (measure_latency)
+        deallocate_cycles.record(core::cpu::rdtsc() - start);
+}
+
+PhysicalAddress allocate_uncached(uint64_t size) {
+    return buddy.alloc(size, FillMode::NONE);
+}
+
+void deallocate_uncached(PhysicalAddress ptr) {
     buddy.free(static_cast<BuddyAllocator::AddressType>(ptr));
 }
-}  // namespace firefly::kernel::mm::Physical
\ No newline at end of file
+
+void free_range(uint64_t base, uint64_t length) {
+    buddy.free_range(base, length);
+}
+
+uint64_t highest_address() {
+    return buddy.get_highest_address();
+}
+
+uint64_t allocate_bulk(PhysicalAddress *out, uint64_t count, uint64_t size, FillMode fill) {
+    const auto order = PageCache::order_of(size);
+    uint64_t n = 0;
+
+    // Whatever the CPU-local cache holds is handed out first, the rest comes straight from the buddy allocators.
+    if (order <= PageCache::max_order)
+        n = page_caches[core::cpu::id()].take(order, out, count);
+
+    n += buddy.alloc_bulk(size, out + n, count - n);
+    if (unlikely(n < count) && reclaim(~0ull))
+        n += buddy.alloc_bulk(size, out + n, count - n);
+
+    if (likely(n > 0))
+        check_watermarks();
+
+    if (fill != FillMode::NONE) {
+        for (uint64_t i = 0; i < n; i++)
+            memset(out[i], fill, PAGE_SIZE << order);
+    }
+
+    if (unlikely(n < count))
+        failures++;
+
+    return n;
+}
+
+void deallocate_bulk(const PhysicalAddress *ptrs, uint64_t count) {
+    auto &cache = page_caches[core::cpu::id()];
+
+    // Consecutive blocks that aren't cached are handed to the buddy allocators as one run.
+    uint64_t run = 0;
+    for (uint64_t n = 0; n < count; n++) {
+        const auto order = ptrs[n] ? cached_order(ptrs[n]) : -1;
+        if (ptrs[n] && order < 0)
+            continue;
+
+        buddy.free_bulk(ptrs + run, n - run);
+        if (ptrs[n])
+            cache.free(ptrs[n], order);
+
+        run = n + 1;
+    }
+
+    buddy.free_bulk(ptrs + run, count - run);
+}
+
+uint64_t refill_zero_pool(uint64_t budget) {
+    return zero_pool.refill([] { return allocate(PAGE_SIZE, FillMode::NONE); }, budget);
+}
+
+ZeroPoolStats zero_pool_stats() {
+    return { .pages = zero_pool.pages(), .hits = zero_pool.hit_count(), .misses = zero_pool.miss_count() };
+}
+Stats stats() {
+    Stats result{};
+
+    for (uint64_t i = 0; i < buddy.zone_count(); i++) {
+        const auto &zone = buddy.zone(i);
+        result.total_pages += zone.range_length() / PAGE_SIZE;
+        result.free_pages += zone.free_bytes() / PAGE_SIZE;
+        result.splits += zone.split_count();
+        result.merges += zone.merge_count();
+    }
+
+    for (const auto &cache : page_caches)
+        result.cached_pages += cache.cached_pages();
+    result.cached_pages += zero_pool.pages();
+
+    result.used_pages = result.total_pages - result.free_pages - result.cached_pages;
+    result.failures = failures;
+
+    const auto largest = buddy.largest_free_order();
+    result.largest_free_order = largest < 0 ? -1 : largest - BuddyAllocator::min_order;
+    if (result.free_pages)
+        result.fragmentation = 1000 - ((largest < 0 ? 0 : 1000ull << result.largest_free_order) / result.free_pages);
+
+    return result;
+}
+
+uint64_t zone_count() {
+    return buddy.zone_count();
+}
+
+ZoneStats zone_stats(uint64_t i) {
+    const auto &zone = buddy.zone(i);
+    ZoneStats result{ .base = virt_to_phys(reinterpret_cast<const void *>(zone.range_base())), .length = zone.range_length(), .free_pages = zone.free_bytes() / PAGE_SIZE, .free_blocks = {} };
+
+    for (int order = 0; order < stat_orders && order + BuddyAllocator::min_order <= zone.max_order; order++)
+        result.free_blocks[order] = zone.free_block_count(order + BuddyAllocator::min_order);
+
+    return result;
+}
+
+uint64_t fragmentation_index(int order) {
+    uint64_t free_pages = 0, unusable_pages = 0;
+
+    for (uint64_t i = 0; i < buddy.zone_count(); i++) {
+        const auto &zone = buddy.zone(i);
+        for (int ord = 0; ord + BuddyAllocator::min_order <= zone.max_order; ord++) {
+            const auto pages = zone.free_block_count(ord + BuddyAllocator::min_order) << ord;
+            free_pages += pages;
+            if (ord < order)
+                unusable_pages += pages;
+        }
+    }
+
+    return free_pages ? (unusable_pages * 1000) / free_pages : 0;
+}
+
+const LatencyHistogram &allocate_latency() {
+    return allocate_cycles;
+}
+
+const LatencyHistogram &deallocate_latency() {
+    return deallocate_cycles;
+}
+
+static void dump_latency(const char *name, const LatencyHistogram &histogram) {
+    if (histogram.samples == 0)
+        return;
+
+    info_logger << info_logger.format("pmm: %s cycles: avg %d, p50 <%d, p99 <%d, max %d (%d calls)\n", name,
+                                      histogram.total_cycles / histogram.samples, histogram.percentile(50), histogram.percentile(99),
+                                      histogram.max_cycles, histogram.samples);
+}
+
+void dump_stats() {
+    // dump_stats() runs during a panic, which it could trigger itself if the allocator state is corrupted.
+    static bool dumping;
+    if (!initialized || dumping)
+        return;
+    dumping = true;
+
+    const auto s = stats();
+    info_logger << info_logger.format("pmm: %d pages total, %d free, %d cached, %d used, %d failed allocations\n",
+                                      s.total_pages, s.free_pages, s.cached_pages, s.used_pages, s.failures);
+    info_logger << info_logger.format("pmm: %d splits, %d merges, fragmentation %d/1000, largest free order %d\n",
+                                      s.splits, s.merges, s.fragmentation, static_cast<uint64_t>(s.largest_free_order < 0 ? 0 : s.largest_free_order));
+
+    // Zones with nothing free are skipped, a fully allocated zone has nothing to report.
+    for (uint64_t i = 0; i < zone_count(); i++) {
+        const auto zone = zone_stats(i);
+        if (zone.free_pages == 0)
+            continue;
+
+        info_logger << info_logger.format("pmm: zone %d [0x%x-0x%x] %d free pages, blocks by order:", i, zone.base, zone.base + zone.length, zone.free_pages);
+        for (int order = 0; order < stat_orders; order++) {
+            if (zone.free_blocks[order])
+                info_logger << info_logger.format(" %d:%d", static_cast<uint64_t>(order), zone.free_blocks[order]);
+        }
+        info_logger << logger::endl;
+    }
+
+    dump_latency("allocate", allocate_cycles);
+    dump_latency("deallocate", deallocate_cycles);
+    dump_reclaim_stats();
+
+    dumping = false;
+}
+}  // namespace firefly::kernel::mm::Physical
@@ -0,0 +1,58 @@
+#include "firefly/memory-manager/secondary/heap.hpp"
+
+#include <cstdlib/cassert.h>
+
+#include "firefly/compiler/clang++.hpp"
+#include "firefly/memory-manager/page.hpp"
+#include "firefly/memory-manager/primary/buddy.hpp"
+#include "firefly/memory-manager/primary/primary_phys.hpp"
+#include "firefly/memory-manager/secondary/slab/slab.hpp"
+
+namespace firefly::kernel::mm {
+void *kmalloc(size_t size) {
+    if (unlikely(size == 0))
+        return nullptr;
+
+    if (likely(size <= slab::max_size))
+        return slab::allocate(size);
+
+    return Physical::allocate(size, FillMode::NONE);
+}
+
+void *kmalloc_aligned(size_t size, size_t align) {
+    assert_truth((align & (align - 1)) == 0 && align <= PAGE_SIZE && "kmalloc_aligned(): Unsupported alignment");
+
+    // Size classes up to 16 bytes are aligned to their size, larger ones to at least 16 bytes.
+    if (align <= 16)
+        return kmalloc(size < align ? align : size);
+
+    // Power-of-two size classes are aligned to their size up to a cache line, pages are always page aligned.
+    if (align <= 64) {
+        const size_t rounded = size <= align ? align : 1ull << (64 - __builtin_clzll(size - 1));
+        if (rounded <= slab::max_size)
+            return slab::allocate(rounded);
+    }
+
+    return Physical::allocate(size < PAGE_SIZE ? PAGE_SIZE : size, FillMode::NONE);
+}
+
+void kfree(void *ptr) {
+    if (ptr == nullptr)
+        return;
+
+    if (auto cache = slab::owner(ptr))
+        return cache->deallocate(ptr);
+
+    assert_truth((reinterpret_cast<uint64_t>(ptr) & (PAGE_SIZE - 1)) == 0 && "kfree(): Pointer was not returned by kmalloc()");
+    Physical::deallocate(ptr);
+}
+
+size_t kmalloc_usable_size(const void *ptr) {
+    if (auto cache = slab::owner(ptr))
+        return cache->stats().object_size;
+
+    // Larger allocations are whole buddy blocks, their size is recorded in the head page.
+    const auto page = pagelist.virt_to_page(ptr);
+    return PAGE_SIZE << (page->order - BuddyAllocator::min_order);
+}
+}  // namespace firefly::kernel::mm
@@ -0,0 +1,164 @@
+#include "firefly/memory-manager/secondary/magazine.hpp"
+
+#include <utility>
+
+#include "firefly/compiler/clang++.hpp"
+#include "firefly/memory-manager/secondary/slab/slab.hpp"
+
+namespace firefly::kernel::mm {
+namespace {
+constexpr int num_sizes = sizeof(MagazineLayer::capacities) / sizeof(MagazineLayer::capacities[0]);
+
+// Magazines are objects themselves, allocated from caches which have no magazine layer of their own.
+SlabCache magazine_caches[num_sizes];
+
+constexpr uint64_t magazine_size(uint32_t capacity) {
+    return sizeof(Magazine) + capacity * sizeof(void *);
+}
+
+static_assert(magazine_size(MagazineLayer::capacities[0]) == 128 && magazine_size(MagazineLayer::capacities[num_sizes - 1]) == 1024);
+}  // namespace
+
+void MagazineLayer::init_magazine_caches() {
+    static const char *names[num_sizes] = { "magazine-14", "magazine-30", "magazine-62", "magazine-126" };
+
+    for (int i = 0; i < num_sizes; i++)
+        magazine_caches[i].init(names[i], magazine_size(capacities[i]), 64, false);
+}
+
+void MagazineLayer::init() {
+    for (auto &cpu : cpus)
+        cpu = {};
+
+    depot_full = depot_empty = nullptr;
+    full_count = empty_count = depot_rounds = 0;
+    size_index = 0;
+    depot_accesses = contended_accesses = total_contended = 0;
+}
+
+void *MagazineLayer::pop() {
+    auto cpu = &cpus[core::cpu::id()];
+
+    if (likely(cpu->loaded && cpu->loaded->rounds))
+        return cpu->loaded->round[--cpu->loaded->rounds];
+
+    if (cpu->previous && cpu->previous->rounds) {
+        std::swap(cpu->loaded, cpu->previous);
+        return cpu->loaded->round[--cpu->loaded->rounds];
+    }
+
+    // Both magazines are empty (or missing): Trade the previous one for a full magazine from the depot.
+    lock_depot();
+    auto full = depot_full;
+    if (full == nullptr) {
+        depot_lock.unlock();
+        return nullptr;
+    }
+
+    depot_full = full->next;
+    full_count--;
+    depot_rounds -= full->rounds;
+
+    if (cpu->previous) {
+        cpu->previous->next = depot_empty;
+        depot_empty = cpu->previous;
+        empty_count++;
+    }
+    depot_lock.unlock();
+
+    cpu->previous = cpu->loaded;
+    cpu->loaded = full;
+    return full->round[--full->rounds];
+}
+
+bool MagazineLayer::push(void *object) {
+    auto cpu = &cpus[core::cpu::id()];
+
+    if (likely(cpu->loaded && cpu->loaded->rounds < cpu->loaded->capacity)) {
+        cpu->loaded->round[cpu->loaded->rounds++] = object;
+        return true;
+    }
+
+    if (cpu->previous && cpu->previous->rounds == 0) {
+        std::swap(cpu->loaded, cpu->previous);
+        cpu->loaded->round[cpu->loaded->rounds++] = object;
+        return true;
+    }
+
+    // Both magazines are full (or missing): Retire the previous one to the depot and load an empty magazine.
+    lock_depot();
+    if (cpu->previous) {
+        cpu->previous->next = depot_full;
+        depot_full = cpu->previous;
+        full_count++;
+        depot_rounds += cpu->previous->rounds;
+    }
+
+    auto empty = depot_empty;
+    if (empty) {
+        depot_empty = empty->next;
+        empty_count--;
+    }
+
+    const auto index = size_index;
+    depot_lock.unlock();
+
+    // Allocating a magazine may run the shrinkers, which purge this CPU's magazines. They must not see one twice.
+    cpu->previous = cpu->loaded;
+    cpu->loaded = nullptr;
+    cpu->loaded = empty ? empty : new_magazine(index);
+
+    if (unlikely(cpu->loaded == nullptr))
+        return false;
+
+    cpu->loaded->round[cpu->loaded->rounds++] = object;
+    return true;
+}
+
+MagazineStats MagazineLayer::stats() const {
+    uint64_t cached = depot_rounds;
+    for (const auto &cpu : cpus) {
+        cached += cpu.loaded ? cpu.loaded->rounds : 0;
+        cached += cpu.previous ? cpu.previous->rounds : 0;
+    }
+
+    return { .capacity = capacities[size_index],
+             .cached = cached,
+             .depot_full = full_count,
+             .depot_empty = empty_count,
+             .contended = total_contended };
+}
+
+void MagazineLayer::lock_depot() {
+    // The counters are only touched with the lock held, contenders would race on them otherwise.
+    const bool contended = !depot_lock.try_lock();
+    if (unlikely(contended)) {
+        depot_lock.lock();
+        contended_accesses++;
+        total_contended++;
+    }
+
+    if (++depot_accesses < contention_window)
+        return;
+
+    if (contended_accesses * 16 > contention_window && size_index < num_sizes - 1)
+        size_index++;
+
+    depot_accesses = contended_accesses = 0;
+}
+
+Magazine *MagazineLayer::new_magazine(int index) {
+    auto magazine = static_cast<Magazine *>(magazine_caches[index].allocate());
+    if (magazine)
+        *magazine = { .next = nullptr, .rounds = 0, .capacity = capacities[index] };
+
+    return magazine;
+}
+
+void MagazineLayer::free_magazine(Magazine *magazine) {
+    for (int i = 0; i < num_sizes; i++) {
+        if (capacities[i] == magazine->capacity)
+            return magazine_caches[i].deallocate(magazine);
+    }
+}
+}  // namespace firefly::kernel::mm
@@ -0,0 +1,80 @@
+/*
+    Global allocation operators, every 'new' in the kernel is served by the kernel heap (see heap.hpp).
+*/
+#include <stddef.h>
+
+#include <new>
+
+#include "firefly/memory-manager/secondary/heap.hpp"
+#include "firefly/panic.hpp"
+
+using firefly::kernel::mm::kfree;
+using firefly::kernel::mm::kmalloc;
+using firefly::kernel::mm::kmalloc_aligned;
+
+namespace {
+// There are no exceptions to throw, running out of memory in 'new' is fatal.
+void *must_kmalloc(size_t size, size_t align) {
+    auto ptr = align > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? kmalloc_aligned(size, align) : kmalloc(size ? size : 1);
+    if (ptr == nullptr)
+        firefly::panic("operator new: Out of memory");
+
+    return ptr;
+}
+}  // namespace
+
+void *operator new(size_t size) {
+    return must_kmalloc(size, 0);
+}
+
+void *operator new[](size_t size) {
+    return must_kmalloc(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    return must_kmalloc(size, static_cast<size_t>(align));
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+    return must_kmalloc(size, static_cast<size_t>(align));
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return kmalloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return kmalloc(size ? size : 1);
+}
+
+void operator delete(void *ptr) noexcept {
+    kfree(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    kfree(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    kfree(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    kfree(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    kfree(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    kfree(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    kfree(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+    kfree(ptr);
+}
@@ -0,0 +1,333 @@
+#include "firefly/memory-manager/secondary/slab/slab.hpp"
+
+#include <cstdlib/cassert.h>
+
+#include "firefly/logger.hpp"
+#include "firefly/memory-manager/page.hpp"
+#include "firefly/memory-manager/primary/primary_phys.hpp"
+#include "firefly/memory-manager/shrinker.hpp"
+
+namespace firefly::kernel::mm {
+SlabCache *SlabCache::caches{ nullptr };
+
+void SlabCache::init(const char *name, uint64_t object_size, uint64_t align, bool magazines) {
+    // Free objects store the freelist link in their first word.
+    align = align < sizeof(void *) ? sizeof(void *) : align;
+
+    this->name = name;
+    size = (object_size + align - 1) & ~(align - 1);
+    first_object = (sizeof(Slab) + align - 1) & ~(align - 1);
+    partial = full = empty = {};
+    in_use = 0;
+
+    use_magazines = magazines;
+    if (use_magazines)
+        magazine_layer.init();
+
+    // Use the smallest slab which wastes at most 1/8th of its memory (or the largest one if none does).
+    for (order = 0; order < max_order; order++) {
+        const uint64_t bytes = PAGE_SIZE << order;
+        const uint64_t objects = bytes > first_object ? (bytes - first_object) / size : 0;
+        const uint64_t waste = bytes - first_object - objects * size;
+
+        if (objects > 0 && waste * 8 <= bytes)
+            break;
+    }
+    objects_per_slab = ((PAGE_SIZE << order) - first_object) / size;
+    assert_truth(objects_per_slab > 0 && "Object is too large for a slab");
+
+    next_cache = caches;
+    caches = this;
+}
+
+void *SlabCache::allocate() {
+    if (likely(use_magazines)) {
+        if (auto object = magazine_layer.pop())
+            return object;
+    }
+
+    libkern::LockGuard guard(lock);
+    return allocate_from_slab();
+}
+
+void SlabCache::deallocate(void *ptr) {
+    if constexpr (sanity_checks) {
+        auto slab = pagelist.virt_to_page(ptr)->slab;
+        const auto offset = reinterpret_cast<uint64_t>(ptr) - reinterpret_cast<uint64_t>(slab) - first_object;
+        assert_truth(slab != nullptr && slab->cache == this && "Object does not belong to this cache");
+        assert_truth(offset % size == 0 && offset / size < objects_per_slab && "Pointer is not the start of an object");
+    }
+
+    if (likely(use_magazines) && magazine_layer.push(ptr))
+        return;
+
+    libkern::LockGuard guard(lock);
+    deallocate_to_slab(ptr);
+}
+
+void *SlabCache::allocate_from_slab() {
+    if (unlikely(partial.head == nullptr)) {
+        if (empty.head == nullptr) {
+            // Physical::allocate() may run the shrinkers, which take the lock themselves. Other CPUs can refill
+            // the lists in the meantime, so the new slab joins the empty list and the lists are checked again.
+            lock.unlock();
+            auto grown = grow();
+            lock.lock();
+
+            if (grown)
+                push(empty, grown);
+            else if (partial.head == nullptr && empty.head == nullptr)
+                return nullptr;
+        }
+
+        if (partial.head == nullptr) {
+            auto slab = empty.head;
+            remove(empty, slab);
+            push(partial, slab);
+        }
+    }
+
+    Slab *slab = partial.head;
+    void *object = slab->freelist;
+    slab->freelist = *static_cast<void **>(object);
+    slab->in_use++;
+    in_use++;
+
+    if (slab->in_use == objects_per_slab) {
+        remove(partial, slab);
+        push(full, slab);
+    }
+
+    return object;
+}
+
+void SlabCache::deallocate_to_slab(void *ptr) {
+    auto slab = pagelist.virt_to_page(ptr)->slab;
+
+    *static_cast<void **>(ptr) = slab->freelist;
+    slab->freelist = ptr;
+    in_use--;
+
+    if (slab->in_use-- == objects_per_slab) {
+        remove(full, slab);
+        push(partial, slab);
+    }
+
+    if (slab->in_use == 0) {
+        remove(partial, slab);
+        push(empty, slab);
+
+        if (empty.count > keep_empty) {
+            remove(empty, slab);
+            release(slab);
+        }
+    }
+}
+
+uint64_t SlabCache::shrink() {
+    if (use_magazines) {
+        magazine_layer.purge([this](void *object) {
+            libkern::LockGuard guard(lock);
+            deallocate_to_slab(object);
+        });
+    }
+
+    libkern::LockGuard guard(lock);
+    uint64_t pages = 0;
+
+    while (empty.head) {
+        auto slab = empty.head;
+        remove(empty, slab);
+        release(slab);
+        pages += 1ull << order;
+    }
+
+    return pages;
+}
+
+SlabCacheStats SlabCache::stats() const {
+    const auto slabs = partial.count + full.count + empty.count;
+
+    return { .name = name,
+             .object_size = size,
+             .objects_per_slab = objects_per_slab,
+             .slab_pages = 1ull << order,
+             .partial = partial.count,
+             .full = full.count,
+             .empty = empty.count,
+             .objects_in_use = in_use,
+             .objects_total = slabs * objects_per_slab,
+             .magazines = use_magazines ? magazine_layer.stats() : MagazineStats{} };
+}
+
+Slab *SlabCache::grow() {
+    auto slab = static_cast<Slab *>(Physical::allocate(PAGE_SIZE << order, FillMode::NONE));
+    if (slab == nullptr)
+        return nullptr;
+
+    *slab = { .next = nullptr, .prev = nullptr, .cache = this, .freelist = nullptr, .in_use = 0 };
+
+    // Thread the freelist back to front so that objects are handed out in address order.
+    auto objects = reinterpret_cast<uint8_t *>(slab) + first_object;
+    for (uint64_t i = objects_per_slab; i-- > 0;) {
+        *reinterpret_cast<void **>(objects + i * size) = slab->freelist;
+        slab->freelist = objects + i * size;
+    }
+
+    auto page = pagelist.virt_to_page(slab);
+    for (uint64_t i = 0; i < (1ull << order); i++) {
+        page[i].flags = RawPageFlags::Slab;
+        page[i].slab = slab;
+    }
+
+    return slab;
+}
+
+void SlabCache::release(Slab *slab) {
+    auto page = pagelist.virt_to_page(slab);
+    for (uint64_t i = 0; i < (1ull << order); i++) {
+        page[i].flags = RawPageFlags::None;
+        page[i].slab = nullptr;
+    }
+
+    Physical::deallocate(slab);
+}
+
+void SlabCache::push(List &list, Slab *slab) {
+    slab->prev = nullptr;
+    slab->next = list.head;
+
+    if (list.head)
+        list.head->prev = slab;
+
+    list.head = slab;
+    list.count++;
+}
+
+void SlabCache::remove(List &list, Slab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        list.head = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+
+    list.count--;
+}
+
+namespace slab {
+// Power-of-two classes plus the sizes halfway between them, which halves the worst case internal fragmentation.
+static constexpr uint64_t size_classes[] = { 8, 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048 };
+static constexpr int num_classes = sizeof(size_classes) / sizeof(size_classes[0]);
+
+static_assert(size_classes[num_classes - 1] == max_size);
+
+static SlabCache caches[num_classes];
+
+// Size class names, "kmalloc-<size>"
+static char names[num_classes][16];
+
+// Size class for every multiple of 8 up to max_size, so picking a class is a single table lookup.
+static uint8_t class_of[max_size / 8 + 1];
+
+// Empty slabs and objects parked in magazines of every cache.
+// Slab pages are freed into the per-CPU page caches, so this runs before their shrinker.
+class SlabShrinker final : public Shrinker {
+public:
+    constexpr SlabShrinker()
+        : Shrinker("slab", 10) {
+    }
+
+    // Objects cached by magazines may free more slabs, but that's only known once they are flushed.
+    uint64_t count() const override {
+        uint64_t pages = 0;
+        for (auto cache = SlabCache::first(); cache; cache = cache->next()) {
+            const auto s = cache->stats();
+            pages += s.empty * s.slab_pages + (s.magazines.cached ? s.slab_pages : 0);
+        }
+
+        return pages;
+    }
+
+    uint64_t scan(uint64_t pages) override {
+        uint64_t freed = 0;
+        for (auto cache = SlabCache::first(); cache && freed < pages; cache = cache->next())
+            freed += cache->shrink();
+
+        return freed;
+    }
+};
+
+static constinit SlabShrinker shrinker;
+
+void init() {
+    MagazineLayer::init_magazine_caches();
+
+    for (int i = 0, c = 0; i <= static_cast<int>(max_size / 8); i++) {
+        while (size_classes[c] < static_cast<uint64_t>(i) * 8)
+            c++;
+        class_of[i] = c;
+    }
+
+    for (int i = 0; i < num_classes; i++) {
+        const auto size = size_classes[i];
+
+        // Power-of-two sizes are naturally aligned (up to a cache line), the others are 16 byte aligned.
+        const uint64_t align = (size & (size - 1)) == 0 ? (size < 64 ? size : 64) : 16;
+
+        auto name = info_logger.format("kmalloc-%d", size);
+        for (int j = 0; name[j] && j < 15; j++)
+            names[i][j] = name[j];
+
+        caches[i].init(names[i], size, align);
+    }
+
+    register_shrinker(shrinker);
+
+    info_logger << info_logger.format("slab: Initialized %d size classes (up to %d bytes)\n", static_cast<uint64_t>(num_classes), max_size);
+}
+
+void *allocate(uint64_t size) {
+    if (unlikely(size > max_size))
+        return nullptr;
+
+    return caches[class_of[(size + 7) / 8]].allocate();
+}
+
+void deallocate(void *ptr) {
+    if (ptr == nullptr)
+        return;
+
+    auto cache = owner(ptr);
+    assert_truth(cache != nullptr && "slab::deallocate(): Pointer is not slab memory");
+    cache->deallocate(ptr);
+}
+
+SlabCache *owner(const void *ptr) {
+    auto page = pagelist.virt_to_page(ptr);
+    return page->flags == RawPageFlags::Slab ? page->slab->cache : nullptr;
+}
+
+void dump_stats() {
+    for (auto cache = SlabCache::first(); cache; cache = cache->next()) {
+        const auto s = cache->stats();
+        if (s.objects_total == 0)
+            continue;
+
+        // Utilization is the share of slab memory occupied by live objects.
+        // Without slabs every object would take up a page of its own.
+        const auto slab_bytes = (s.partial + s.full + s.empty) * s.slab_pages * PAGE_SIZE;
+        info_logger << info_logger.format("slab: %s: %d/%d objects in %d slabs (%d partial, %d full, %d empty), utilization %d percent, %d KiB instead of %d KiB\n",
+                                          s.name, s.objects_in_use, s.objects_total, s.partial + s.full + s.empty, s.partial, s.full, s.empty,
+                                          (s.objects_in_use * s.object_size * 100) / slab_bytes, slab_bytes >> 10, (s.objects_in_use * PAGE_SIZE) >> 10);
+
+        if (s.magazines.capacity) {
+            info_logger << info_logger.format("slab: %s: %d objects in magazines of %d, depot: %d full, %d empty, %d contended\n",
+                                              s.name, s.magazines.cached, s.magazines.capacity, s.magazines.depot_full, s.magazines.depot_empty,
+                                              s.magazines.contended);
+        }
+    }
+}
+}  // namespace slab
+}  // namespace firefly::kernel::mm
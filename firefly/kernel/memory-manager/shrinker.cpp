@@ -0,0 +1,69 @@
+#include "firefly/memory-manager/shrinker.hpp"
+
+#include <atomic>
+
+#include "firefly/logger.hpp"
+
+namespace firefly::kernel::mm {
+namespace {
+Shrinker *shrinkers{ nullptr };
+ReclaimStats stats{};
+std::atomic_bool reclaiming{};
+}  // namespace
+
+void register_shrinker(Shrinker &shrinker) {
+    for (auto registered = shrinkers; registered; registered = registered->next) {
+        if (registered == &shrinker)
+            return;
+    }
+
+    auto link = &shrinkers;
+    while (*link && (*link)->priority <= shrinker.priority)
+        link = &(*link)->next;
+
+    shrinker.next = *link;
+    *link = &shrinker;
+}
+
+uint64_t reclaim(uint64_t pages, ReclaimReason reason) {
+    // Shrinkers free memory, which may end up calling back into the allocator that asked for reclaim.
+    // Only one CPU reclaims at a time, the others don't wait for it: Their allocation fails if nothing is left.
+    // This doesn't protect against shrinkers taking locks of the allocating CPU, see Shrinker::scan().
+    if (pages == 0 || reclaiming.exchange(true, std::memory_order_acquire))
+        return 0;
+
+    uint64_t freed = 0;
+    for (auto shrinker = shrinkers; shrinker && freed < pages; shrinker = shrinker->next) {
+        if (shrinker->last_resort && reason != ReclaimReason::AllocationFailure)
+            continue;
+
+        if (shrinker->count() == 0)
+            continue;
+
+        const auto n = shrinker->scan(pages - freed);
+        shrinker->reclaimed += n;
+        freed += n;
+    }
+
+    stats.runs++;
+    stats.pages += freed;
+    if (freed < pages)
+        stats.shortfalls++;
+
+    reclaiming.store(false, std::memory_order_release);
+    return freed;
+}
+
+ReclaimStats reclaim_stats() {
+    return stats;
+}
+
+void dump_reclaim_stats() {
+    if (stats.runs == 0)
+        return;
+
+    info_logger << info_logger.format("reclaim: %d pages in %d runs, %d short\n", stats.pages, stats.runs, stats.shortfalls);
+    for (auto shrinker = shrinkers; shrinker; shrinker = shrinker->next)
+        info_logger << info_logger.format("reclaim: %s: %d pages reclaimed, %d reclaimable\n", shrinker->name, shrinker->reclaimed, shrinker->count());
+}
+}  // namespace firefly::kernel::mm
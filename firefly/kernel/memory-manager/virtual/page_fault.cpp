@@ -0,0 +1,57 @@
+#include "firefly/memory-manager/virtual/page_fault.hpp"
+
+#include "firefly/intel64/cpu.hpp"
+#include "firefly/logger.hpp"
+#include "firefly/memory-manager/mm.hpp"
+#include "firefly/memory-manager/virtual/vmalloc.hpp"
+
+namespace firefly::kernel::mm {
+
+// Faults run with interrupts disabled, the counters only need to be consistent per CPU.
+// Todo: Make them per-CPU once the APs are brought up.
+static uint64_t minor_faults, unresolved;
+static Physical::LatencyHistogram fault_cycles;
+
+// Find the region 'address' belongs to and let its owner back the page.
+// Only the kernel half has regions with pages backed on demand so far, there is no user space yet.
+static bool resolve(uint64_t address, uint64_t error) {
+    if (error & (PageFaultError::Present | PageFaultError::ReservedBit | PageFaultError::User))
+        return false;
+
+    if (address >= AddressLayout::Vmalloc && address < AddressLayout::PageData)
+        return vmalloc_fault(address);
+
+    return false;
+}
+
+bool handle_page_fault(uint64_t address, uint64_t error) {
+    const auto start = core::cpu::rdtsc();
+
+    if (!resolve(address, error)) {
+        unresolved++;
+        return false;
+    }
+
+    minor_faults++;
+    fault_cycles.record(core::cpu::rdtsc() - start);
+    return true;
+}
+
+PageFaultStats page_fault_stats() {
+    return { .minor_faults = minor_faults, .unresolved = unresolved };
+}
+
+const Physical::LatencyHistogram &page_fault_latency() {
+    return fault_cycles;
+}
+
+void dump_page_fault_stats() {
+    info_logger << info_logger.format("page faults: %d minor, %d unresolved\n", minor_faults, unresolved);
+    if (fault_cycles.samples == 0)
+        return;
+
+    info_logger << info_logger.format("page faults: cycles avg %d, p50 <%d, p99 <%d, max %d\n",
+                                      fault_cycles.total_cycles / fault_cycles.samples, fault_cycles.percentile(50),
+                                      fault_cycles.percentile(99), fault_cycles.max_cycles);
+}
+}  // namespace firefly::kernel::mm
@@ -1,29 +1,115 @@
 #include "firefly/memory-manager/virtual/virtual.hpp"
 
+#include <algorithm>
+
 #include "firefly/console/stivale2-term.hpp"
+#include "firefly/intel64/cpu.hpp"
 #include "firefly/logger.hpp"
+#include "firefly/memory-manager/page.hpp"
 #include "firefly/memory-manager/primary/primary_phys.hpp"
 #include "firefly/panic.hpp"
+#include "libk++/align.h"
 #include "libk++/bits.h"
 
 namespace firefly::kernel::mm {
 
 frg::manual_box<kernelPageSpace> kPageSpaceSingleton{};
 
+static constexpr bool identity_map_low = true;
+
+// RAM ranges of the memory map, page aligned and sorted. Adjacent entries are only merged if their types match,
+// so that no large page of the direct map spans two types (and possibly two caching types).
+struct DirectMapRange {
+    uint64_t base, end;
+    uint32_t type;
+};
+
+static constexpr uint64_t max_direct_map_ranges = 128;
+static DirectMapRange direct_map_ranges[max_direct_map_ranges];
+static uint64_t num_direct_map_ranges{};
+
+static bool is_ram(uint32_t type) {
+    switch (type) {
+        case STIVALE2_MMAP_USABLE:
+        case STIVALE2_MMAP_ACPI_RECLAIMABLE:
+        case STIVALE2_MMAP_ACPI_NVS:
+        case STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE:
+        case STIVALE2_MMAP_KERNEL_AND_MODULES:
+            return true;
+        default:
+            return false;
+    }
+}
+
 kernelPageSpace &kernelPageSpace::accessor() {
     return *kPageSpaceSingleton;
 }
 
+void kernelPageSpace::record_memory_map(const stivale2_struct_tag_memmap *mmap) {
+    for (uint64_t i = 0; i < mmap->entries; i++) {
+        const auto &e = mmap->memmap[i];
+        if (!is_ram(e.type))
+            continue;
+
+        auto base = libkern::align_down4k(e.base);
+        const auto end = libkern::align_up4k(e.base + e.length);
+
+        if (num_direct_map_ranges) {
+            auto &last = direct_map_ranges[num_direct_map_ranges - 1];
+
+            // A page shared by two unaligned entries belongs to the first one.
+            base = std::max(base, last.end);
+            if (base >= end)
+                continue;
+
+            if (base == last.end && e.type == last.type) {
+                last.end = end;
+                continue;
+            }
+        }
+
+        if (num_direct_map_ranges == max_direct_map_ranges)
+            firefly::panic("Too many memory map entries for the direct map");
+
+        direct_map_ranges[num_direct_map_ranges++] = { base, end, e.type };
+    }
+}
+
 void kernelPageSpace::init() {
+    const auto start = core::cpu::rdtsc();
+    const auto tables = core::paging::page_table_count();
+
     auto pml4 = static_cast<T *>(Physical::must_allocate());
     kPageSpaceSingleton.initialize(pml4);
 
-    kPageSpaceSingleton.get()->mapRange(0, GiB(4), AccessFlags::ReadWrite, AddressLayout::Low);
-    kPageSpaceSingleton.get()->mapRange(0, GiB(2), AccessFlags::ReadWrite, AddressLayout::High);
-    kPageSpaceSingleton.get()->mapRange(0, GiB(2), AccessFlags::ReadWrite, AddressLayout::Code);
-	kPageSpaceSingleton.get()->mapRange(0, GiB(1), AccessFlags::ReadWrite, AddressLayout::PageData);
+    // The kernel half is the same in every address space, its translations can survive address space switches.
+    constexpr auto kernel_flags = AccessFlags::ReadWrite | AccessFlags::Global;
+
+    // Holes, MMIO and the framebuffer are left out, a large page only spans one entry of the memory map.
+    uint64_t direct_map_size = 0;
+    for (uint64_t i = 0; i < num_direct_map_ranges; i++) {
+        const auto &range = direct_map_ranges[i];
+        kPageSpaceSingleton.get()->mapRange(range.base, range.end - range.base, kernel_flags, AddressLayout::High);
+        direct_map_size += range.end - range.base;
+    }
+    kPageSpaceSingleton.get()->mapRange(0, GiB(2), kernel_flags, AddressLayout::Code);
+
+    // Todo: Nothing in the kernel goes through the identity map anymore, but the stivale2 terminal still accesses
+    // the framebuffer through it. It can go once there is a console of our own.
+    if constexpr (identity_map_low)
+        kPageSpaceSingleton.get()->mapRange(0, GiB(4), AccessFlags::ReadWrite, AddressLayout::Low);
+
+    // Only parts of the page array are backed, map exactly the runs the pagelist set up at boot.
+    pagelist.for_each_run([](uint64_t virt, uint64_t phys, uint64_t length) {
+        core::paging::map_range(virt, phys, length, kernel_flags, reinterpret_cast<const uint64_t *>(kPageSpaceSingleton.get()->root()));
+    });
     kPageSpaceSingleton.get()->loadAddressSpace();
+    core::paging::init_global_pages();
+    core::paging::init_pcid();
 
-    info_logger << "vmm: Initialized" << logger::endl;
+    // The PML4 isn't counted as a page table.
+    const auto table_pages = core::paging::page_table_count() - tables + 1;
+    info_logger << info_logger.format("vmm: Initialized in %d cycles, %d KiB of page tables (1GiB pages: %s), %d MiB direct map\n", core::cpu::rdtsc() - start,
+                                      (table_pages * PAGE_SIZE) >> 10, core::paging::huge_pages_supported() ? "yes" : "no", direct_map_size >> 20);
 }
 }  // namespace firefly::kernel::mm
\ No newline at end of file
@@ -0,0 +1,400 @@
+#include "firefly/memory-manager/virtual/vmalloc.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+#include "firefly/compiler/clang++.hpp"
+#include "firefly/intel64/cpu.hpp"
+#include "firefly/intel64/paging.hpp"
+#include "firefly/logger.hpp"
+#include "firefly/memory-manager/hhdm.hpp"
+#include "firefly/memory-manager/primary/primary_phys.hpp"
+#include "firefly/memory-manager/secondary/slab/object_cache.hpp"
+#include "firefly/memory-manager/virtual/virtual.hpp"
+#include "firefly/panic.hpp"
+#include "libk++/avl_tree.h"
+#include "libk++/spinlock.h"
+
+namespace firefly::kernel::mm {
+
+enum class VmKind : uint8_t {
+    Reserved,  // vm_reserve(), mapped by its owner
+    Backed,    // vmalloc()
+    Demand     // vmalloc_lazy(), backed page by page on the first access
+};
+
+// A range of the vmalloc region. Free ranges are kept in one tree, areas in use in another one,
+// freed areas sit on the lazy list until the next purge.
+struct VmArea {
+    uint64_t start;
+    uint64_t size;   // Bytes, areas include their guard page
+    uint64_t pages;  // Pages mapped by vmalloc() and the page fault handler
+    VmKind kind;
+    VmArea *left, *right;
+    int height;
+    uint64_t largest;  // Free ranges: The largest free range in the subtree
+    VmArea *next;      // Lazy list
+};
+
+struct FreeRangeTraits {
+    static uint64_t key(const VmArea *range) {
+        return range->start;
+    }
+
+    static void update(VmArea *range) {
+        auto largest = range->size;
+        if (range->left)
+            largest = std::max(largest, range->left->largest);
+        if (range->right)
+            largest = std::max(largest, range->right->largest);
+
+        range->largest = largest;
+    }
+};
+
+struct AreaTraits {
+    static uint64_t key(const VmArea *area) {
+        return area->start;
+    }
+
+    static void update(VmArea *) {
+    }
+};
+
+// The page fault handler takes the lock too, a fault on the CPU holding it would spin forever. The owner is tracked
+// so that such a fault panics instead. The lock is never held across page allocations, which may run reclaim.
+class VmallocLock {
+public:
+    void lock() {
+        spinlock.lock();
+        owner.store(core::cpu::id() + 1, std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        owner.store(0, std::memory_order_relaxed);
+        spinlock.unlock();
+    }
+
+    bool held_here() const {
+        return owner.load(std::memory_order_relaxed) == core::cpu::id() + 1;
+    }
+
+private:
+    libkern::Spinlock spinlock;
+    std::atomic<uint32_t> owner{};
+};
+
+static constexpr uint64_t region_base = AddressLayout::Vmalloc, region_end = AddressLayout::PageData;
+
+// Freed areas keep their (stale) TLB entries until a purge, 32MiB worth of them are collected before the TLB is flushed.
+// Their pages are freed right away: Only a use-after-free could go through a stale entry, just like through the direct map.
+static constexpr uint64_t lazy_max_pages = 8192;
+static constexpr uint64_t batch = 64;
+
+// Nodes come out of the cache zeroed.
+static constinit ObjectCache<VmArea, false> vm_areas{ "vm-area" };
+static VmallocLock lock;
+static libkern::AvlTree<VmArea, FreeRangeTraits> free_ranges;
+static libkern::AvlTree<VmArea, AreaTraits> areas;
+static VmArea *lazy;
+static uint64_t lazy_pages, mapped_pages, purges;
+
+static inline const uint64_t *kernel_pml4() {
+    return reinterpret_cast<const uint64_t *>(kernelPageSpace::accessor().root());
+}
+
+// Put [start, start + size) back into the free tree, merged with the free ranges next to it. 'node' is reused.
+static void release_range(VmArea *node, uint64_t start, uint64_t size) {
+    if (auto prev = free_ranges.floor(start); prev && prev->start + prev->size == start) {
+        free_ranges.remove(prev);
+        start = prev->start;
+        size += prev->size;
+        vm_areas.deallocate(prev);
+    }
+
+    if (auto next = free_ranges.ceil(start + size); next && next->start == start + size) {
+        free_ranges.remove(next);
+        size += next->size;
+        vm_areas.deallocate(next);
+    }
+
+    node->start = start;
+    node->size = size;
+    free_ranges.insert(node);
+}
+
+// Flush the TLB once for all lazily freed areas and return them to the free tree.
+// Mappings of the region are global, a CR3 reload wouldn't drop them.
+static void purge() {
+    core::paging::flush_all_contexts();
+
+    while (lazy) {
+        auto area = lazy;
+        lazy = area->next;
+        release_range(area, area->start, area->size);
+    }
+
+    lazy_pages = 0;
+    purges++;
+}
+
+// Lowest free range which can hold 'size' bytes at any alignment up to 'align'.
+static VmArea *find_free(uint64_t size, uint64_t align) {
+    const auto needed = size + align - PAGE_SIZE;
+
+    for (auto range = free_ranges.root(); range && range->largest >= needed;) {
+        if (range->left && range->left->largest >= needed)
+            range = range->left;
+        else if (range->size >= needed)
+            return range;
+        else
+            range = range->right;
+    }
+
+    return nullptr;
+}
+
+// Nodes for reserve_area(), allocated before the lock is taken because the node cache may have to grow.
+// Whatever reserve_area() didn't use goes back to the cache.
+struct AreaNodes {
+    VmArea *area = vm_areas.allocate(), *spare = vm_areas.allocate();
+
+    ~AreaNodes() {
+        if (area)
+            vm_areas.deallocate(area);
+        if (spare)
+            vm_areas.deallocate(spare);
+    }
+};
+
+// Cut an area of 'size' bytes (and a guard page) aligned to 'align' out of the free ranges.
+static VmArea *reserve_area(uint64_t size, uint64_t align, VmKind kind, AreaNodes &nodes) {
+    size += PAGE_SIZE;
+
+    auto range = find_free(size, align);
+    if (range == nullptr && lazy) {
+        purge();
+        range = find_free(size, align);
+    }
+
+    if (range == nullptr)
+        return nullptr;
+
+    // Up to two free pieces remain, one in front of the area and one behind it.
+    const auto start = (range->start + align - 1) & ~(align - 1);
+    const auto head = start - range->start, tail = range->start + range->size - (start + size);
+
+    if (unlikely(nodes.area == nullptr || (head && tail && nodes.spare == nullptr)))
+        return nullptr;
+
+    auto area = std::exchange(nodes.area, nullptr);
+    auto tail_range = head && tail ? std::exchange(nodes.spare, nullptr) : nullptr;
+
+    free_ranges.remove(range);
+    if (head) {
+        range->size = head;
+        free_ranges.insert(range);
+    }
+
+    if (tail) {
+        if (!head)
+            tail_range = range;
+
+        tail_range->start = start + size;
+        tail_range->size = tail;
+        free_ranges.insert(tail_range);
+    }
+
+    if (!head && !tail)
+        vm_areas.deallocate(range);
+
+    area->start = start;
+    area->size = size;
+    area->kind = kind;
+    areas.insert(area);
+    return area;
+}
+
+// Unmap and free the pages of 'area', their TLB entries stay until the next purge.
+// Areas backed on demand may have holes, unmapped tables are skipped as a whole.
+static void unmap_area(VmArea *area) {
+    core::paging::Cursor cursor(kernel_pml4());
+    PhysicalAddress pages[batch];
+    uint64_t count = 0;
+
+    for (uint64_t addr = area->start, end = area->start + area->size - PAGE_SIZE; addr < end;) {
+        uint64_t size, phys;
+        if (cursor.leaf(addr, size) && cursor.clear(addr, phys))
+            pages[count++] = phys_to_virt(phys);
+
+        addr = (addr & ~(size - 1)) + size;
+        if (count == batch || addr >= end) {
+            Physical::deallocate_bulk(pages, count);
+            count = 0;
+        }
+    }
+
+    mapped_pages -= area->pages;
+    area->pages = 0;
+}
+
+// Move 'area' to the lazy list, its range becomes available again with the next purge.
+static void retire_area(VmArea *area) {
+    areas.remove(area);
+
+    area->next = lazy;
+    lazy = area;
+    lazy_pages += area->size / PAGE_SIZE;
+
+    if (lazy_pages >= lazy_max_pages)
+        purge();
+}
+
+void *vmalloc(size_t size) {
+    if (unlikely(size == 0))
+        return nullptr;
+
+    const uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    VmArea *area;
+    {
+        AreaNodes nodes;
+        libkern::LockGuard guard(lock);
+        area = reserve_area(pages * PAGE_SIZE, PAGE_SIZE, VmKind::Backed, nodes);
+        if (area == nullptr)
+            return nullptr;
+    }
+
+    PhysicalAddress frames[batch];
+
+    // The area belongs to the caller until it returns, the lock only covers the page tables and the counters.
+    while (area->pages < pages) {
+        const auto wanted = std::min(batch, pages - area->pages);
+        const auto allocated = Physical::allocate_bulk(frames, wanted, PAGE_SIZE, FillMode::NONE);
+
+        libkern::LockGuard guard(lock);
+        core::paging::Cursor cursor(kernel_pml4());
+        for (uint64_t i = 0; i < allocated; i++)
+            cursor.map(area->start + (area->pages + i) * PAGE_SIZE, virt_to_phys(frames[i]), AccessFlags::ReadWrite | AccessFlags::Global);
+
+        area->pages += allocated;
+        mapped_pages += allocated;
+
+        if (unlikely(allocated < wanted)) {
+            unmap_area(area);
+            retire_area(area);
+            return nullptr;
+        }
+    }
+
+    return reinterpret_cast<void *>(area->start);
+}
+
+void *vmalloc_lazy(size_t size) {
+    if (unlikely(size == 0))
+        return nullptr;
+
+    AreaNodes nodes;
+    libkern::LockGuard guard(lock);
+    auto area = reserve_area((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1ull), PAGE_SIZE, VmKind::Demand, nodes);
+
+    return area ? reinterpret_cast<void *>(area->start) : nullptr;
+}
+
+// Whether 'address' lies in a vmalloc_lazy() area. The guard page is part of the area, but it's never backed.
+static bool is_demand_backed(uint64_t address) {
+    auto area = areas.floor(address);
+    return area && area->kind == VmKind::Demand && address < area->start + area->size - PAGE_SIZE;
+}
+
+bool vmalloc_fault(uint64_t address) {
+    if (unlikely(lock.held_here()))
+        firefly::panic("vmalloc_fault(): Page fault while holding the vmalloc lock");
+
+    {
+        libkern::LockGuard guard(lock);
+        if (!is_demand_backed(address))
+            return false;
+    }
+
+    // Allocated without the lock, the area is looked up again in case it was freed meanwhile.
+    auto frame = Physical::allocate(PAGE_SIZE, FillMode::ZERO);
+    if (frame == nullptr)
+        return false;
+
+    const auto page = address & ~(PAGE_SIZE - 1ull);
+    libkern::LockGuard guard(lock);
+    core::paging::Cursor cursor(kernel_pml4());
+
+    // Already backed, i.e. by another CPU faulting on the same page. Retrying the access is all that's left to do.
+    uint64_t size;
+    const bool backed = is_demand_backed(address);
+    if (!backed || cursor.leaf(page, size)) {
+        Physical::deallocate(frame);
+        return backed;
+    }
+
+    cursor.map(page, virt_to_phys(frame), AccessFlags::ReadWrite | AccessFlags::Global);
+    areas.floor(address)->pages++;
+    mapped_pages++;
+    return true;
+}
+
+void vfree(void *ptr) {
+    if (ptr == nullptr)
+        return;
+
+    libkern::LockGuard guard(lock);
+
+    auto area = areas.find(reinterpret_cast<uint64_t>(ptr));
+    if (unlikely(area == nullptr || area->kind == VmKind::Reserved))
+        firefly::panic("vfree(): Pointer was not returned by vmalloc()");
+
+    unmap_area(area);
+    retire_area(area);
+}
+
+uint64_t vm_reserve(uint64_t size, uint64_t align) {
+    assert_truth((align & (align - 1)) == 0 && align >= PAGE_SIZE && "vm_reserve(): Bad alignment");
+    if (unlikely(size == 0))
+        return 0;
+
+    AreaNodes nodes;
+    libkern::LockGuard guard(lock);
+    auto area = reserve_area((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1ull), align, VmKind::Reserved, nodes);
+
+    return area ? area->start : 0;
+}
+
+void vm_release(uint64_t base) {
+    libkern::LockGuard guard(lock);
+
+    auto area = areas.find(base);
+    if (unlikely(area == nullptr || area->kind != VmKind::Reserved))
+        firefly::panic("vm_release(): Range was not returned by vm_reserve()");
+
+    // The caller already took care of the TLB, the range can be reused right away.
+    areas.remove(area);
+    release_range(area, area->start, area->size);
+}
+
+VmallocStats vmalloc_stats() {
+    libkern::LockGuard guard(lock);
+
+    return { .areas = areas.size(),
+             .mapped_pages = mapped_pages,
+             .free_ranges = free_ranges.size(),
+             .largest_free = free_ranges.root() ? free_ranges.root()->largest : 0,
+             .lazy_pages = lazy_pages,
+             .purges = purges };
+}
+
+void init_vmalloc() {
+    auto range = vm_areas.allocate();
+    if (range == nullptr)
+        firefly::panic("Unable to set up the vmalloc region");
+
+    release_range(range, region_base, region_end - region_base);
+    info_logger << info_logger.format("vmalloc: %d GiB at 0x%x\n", (region_end - region_base) >> 30, region_base);
+}
+}  // namespace firefly::kernel::mm
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+namespace firefly::kernel::core::cpu {
+// Upper bound of CPUs per-CPU data structures are sized for.
+static constexpr uint32_t max_cpus = 64;
+
+/**
+ *                      Index of the executing CPU
+ * @return              A value in the range [0, max_cpus)
+ */
+[[nodiscard]] inline uint32_t id() {
+    // Todo: Only the BSP is running. Read this from per-CPU data once the APs are brought up.
+    return 0;
+}
+
+struct CpuidResult {
+    uint32_t eax, ebx, ecx, edx;
+};
+
+/**
+ *                      Execute CPUID
+ * @param leaf          Value of EAX
+ * @param subleaf       Value of ECX, only used by some leaves
+ * @return              Registers as returned by CPUID
+ */
+[[nodiscard]] inline CpuidResult cpuid(uint32_t leaf, uint32_t subleaf = 0) {
+    CpuidResult result;
+    asm volatile("cpuid"
+                 : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx)
+                 : "a"(leaf), "c"(subleaf));
+    return result;
+}
+
+/**
+ *                      Read the time-stamp counter
+ * @return              Cycles elapsed since the last reset
+ */
+[[nodiscard]] inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile(
+        "lfence\n"
+        "rdtsc"
+        : "=a"(lo), "=d"(hi)
+        :
+        : "memory");
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+/**
+ *                      Read CR2
+ * @return              Linear address of the last page fault
+ */
+[[nodiscard]] inline uint64_t read_cr2() {
+    uint64_t cr2;
+    asm volatile("mov %%cr2, %0"
+                 : "=r"(cr2));
+    return cr2;
+}
+}  // namespace firefly::kernel::core::cpu
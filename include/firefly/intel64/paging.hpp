@@ -11,9 +11,17 @@ enum class AccessFlags : int {
     Readonly = 1,
     ReadWrite = 3,
     UserReadOnly = 5,
-    UserReadWrite = 7
+    UserReadWrite = 7,
+
+    // Combined with the flags above: The translation is kept across address space switches (CR4.PGE).
+    // Only for mappings every address space shares, i.e. the kernel half.
+    Global = 0x100
 };
 
+constexpr AccessFlags operator|(AccessFlags a, AccessFlags b) {
+    return static_cast<AccessFlags>(static_cast<int>(a) | static_cast<int>(b));
+}
+
 // TODO: Implement me!
 enum class CacheMode : int {
     None,
@@ -23,8 +31,154 @@ enum class CacheMode : int {
     WriteBack
 };
 
+// Size of the memory mapped by a single leaf entry.
+enum class PageSize : uint64_t {
+    Small = 0x1000,     // 4KiB, PT entry
+    Large = 0x200000,   // 2MiB, PD entry with the PS bit set
+    Huge = 0x40000000   // 1GiB, PDPT entry with the PS bit set, see huge_pages_supported()
+};
+
+// Process-context identifier of an address space, it tags the address space's TLB entries (CR3[11:0], CR4.PCIDE).
+// Switching between address spaces with valid PCIDs keeps their TLB entries. Identifiers are handed out on first use,
+// once all 4095 have been used a new generation starts: The whole TLB is flushed and older identifiers become invalid,
+// their address spaces get a new one when they are loaded next.
+struct Pcid {
+    uint16_t id{};
+    uint64_t generation{};  // 0: No identifier assigned
+
+    // The kernel address space keeps PCID 0 forever.
+    static constexpr uint64_t pinned = ~0ull;
+    static constexpr Pcid kernel() {
+        return { .id = 0, .generation = pinned };
+    }
+};
+
+bool pcid_supported();
+bool invpcid_supported();
+
+// Enable global pages (CR4.PGE), AccessFlags::Global has no effect without it. Flushes the whole TLB.
+void init_global_pages();
+
+// Flush every TLB entry, global ones and those of every PCID included.
+void flush_all_contexts();
+
+// Enable PCIDs if the CPU supports them, the kernel address space must be loaded.
+void init_pcid();
+
+// Load the address space. Its TLB entries are kept if 'pcid' is still valid (and PCIDs are enabled).
+void load_address_space(const uint64_t *pml_ptr, Pcid &pcid);
+
 void invalidatePage(const VirtualAddress page);
 void invalidatePage(const uint64_t page);
-void map(const uint64_t virtual_addr, const uint64_t physical_addr, AccessFlags access_flags, const uint64_t *pml_ptr);
-void boot_map_extra_region(stivale2_struct_tag_memmap *mmap);
+
+// The functions below change the address space 'pml_ptr' (its PML4 in the direct map), 'pcid' is its PCID (if it has one).
+// Address spaces which aren't loaded only need their TLB entries invalidated if they have a valid PCID.
+
+// Both addresses must be aligned to 'size'.
+void map(const uint64_t virtual_addr, const uint64_t physical_addr, AccessFlags access_flags, const uint64_t *pml_ptr, PageSize size = PageSize::Small, Pcid *pcid = nullptr);
+
+// Map [physical_addr, physical_addr + length) at 'virtual_addr' using the largest pages alignment and length allow.
+void map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t length, AccessFlags access_flags, const uint64_t *pml_ptr, Pcid *pcid = nullptr);
+
+// Change the access flags of every page mapped in [virtual_addr, virtual_addr + length), unmapped parts are skipped.
+void protect_range(uint64_t virtual_addr, uint64_t length, AccessFlags access_flags, const uint64_t *pml_ptr, Pcid *pcid = nullptr);
+
+// Remove the mappings of [virtual_addr, virtual_addr + length), unmapped parts are skipped.
+// Large pages must be covered entirely, they aren't split. Page tables covered entirely by the range are freed.
+void unmap(uint64_t virtual_addr, const uint64_t *pml_ptr, Pcid *pcid = nullptr);
+void unmap_range(uint64_t virtual_addr, uint64_t length, const uint64_t *pml_ptr, Pcid *pcid = nullptr);
+
+// Invalidating up to this many pages after a change is done page by page (invlpg),
+// beyond it the whole TLB is flushed. Tunable at runtime, i.e. by the benchmarks. (Capped at max_flush_threshold)
+static constexpr uint64_t max_flush_threshold = 64;
+void set_flush_threshold(uint64_t pages);
+uint64_t flush_threshold();
+
+// Walks the page tables of one address space for a sequence of operations on nearby addresses.
+// The tables of the last walk are remembered, so consecutive addresses only look at the levels that changed
+// (and missing tables are created once), which makes range operations linear in the number of leaf entries.
+// TLB invalidation is deferred: Changed leaves are collected and flushed together by flush() or the destructor.
+// Address spaces which aren't loaded are invalidated by PCID (INVPCID) or lose their PCID if there's no INVPCID,
+// without a valid PCID they have no TLB entries to invalidate. Global entries are cached for every address space,
+// they are invalidated with invlpg (which drops them for all PCIDs) or by flushing everything.
+class Cursor {
+public:
+    explicit Cursor(const uint64_t *pml_ptr, Pcid *pcid = nullptr);
+    ~Cursor();
+
+    Cursor(const Cursor &) = delete;
+    Cursor &operator=(const Cursor &) = delete;
+
+    // Both addresses must be aligned to 'size'. Large pages replace empty tables left behind by unmapped smaller pages,
+    // mapping one over live smaller pages panics.
+    void map(uint64_t virtual_addr, uint64_t physical_addr, AccessFlags access_flags, PageSize size = PageSize::Small);
+
+    // Leaf entry mapping 'virtual_addr' and the size of the page it maps in bytes.
+    // nullptr if there is none, 'size' is then the size of the unmapped, naturally aligned hole around the address.
+    uint64_t *leaf(uint64_t virtual_addr, uint64_t &size);
+
+    // Free the (empty) table at 'level' covering 'virtual_addr' and clear the entry pointing to it.
+    // The table is freed once the TLB has been flushed, tables which didn't come from the page table cache are kept.
+    void release_table(uint64_t virtual_addr, int level);
+
+    // Queue the TLB entry of the page at 'virtual_addr' for invalidation, 'global' if the old entry was global.
+    void invalidate(uint64_t virtual_addr, bool global = false);
+
+    // Clear the 4KiB leaf entry of 'virtual_addr' and store the address it mapped in 'physical_addr'.
+    // The TLB entry is left alone: The caller flushes it before the address is mapped again. False if nothing was mapped.
+    bool clear(uint64_t virtual_addr, uint64_t &physical_addr);
+
+    // Invalidate every queued TLB entry.
+    void flush();
+
+private:
+    // Table at 'level' (1: PT, 2: PD, 3: PDPT, 4: PML4) covering 'virtual_addr'.
+    // Missing tables are created with 'create_flags', unless it is 0: Then nullptr is returned instead.
+    uint64_t *table(uint64_t virtual_addr, int level, uint64_t create_flags);
+
+    // Release the table at 'level' covering 'virtual_addr' and the tables below it, none of them may map anything.
+    void release_subtree(uint64_t virtual_addr, int level);
+
+    static constexpr int max_released = 16;
+
+    // Where the TLB entries of the address space live
+    enum class Target {
+        None,    // Nowhere, it isn't loaded and has no valid PCID
+        Loaded,  // It's the current address space: invlpg and CR3 reloads
+        Tagged   // Tagged with a PCID that isn't current
+    };
+
+    uint64_t *pml4;
+    Pcid *pcid;
+    Target target;
+
+    // tables[level] is the table at 'level' the last walk went through, it covers the addresses whose
+    // bits above that level's coverage equal prefixes[level].
+    uint64_t *tables[4]{};  // Index 0 is unused
+    uint64_t prefixes[4]{};
+
+    uint64_t pending[max_flush_threshold];
+    uint64_t num_pending{};
+    bool flush_all{};
+    bool global{};  // Global entries are pending
+
+    uint64_t *released[max_released];
+    int num_released{};
+};
+
+// Whether the CPU supports 1GiB pages (CPUID.80000001H:EDX.Page1GB)
+bool huge_pages_supported();
+
+// Number of page tables in use, including those of the early allocator.
+uint64_t page_table_count();
+
+// Page tables are taken from a small early allocator until the physical memory manager is up.
+// Its region is taken out of the memory map, early_allocator_range() tells the physical memory manager where it is
+// and release_early_allocator() hands the pages it didn't use over to it.
+void init_early_allocator(stivale2_struct_tag_memmap *mmap);
+PhysicalRange early_allocator_range();
+void release_early_allocator();
+
+// Map a range into the address space that is currently loaded. (Boot time only)
+void boot_map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t length);
 }  // namespace firefly::kernel::core::paging
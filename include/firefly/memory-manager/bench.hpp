@@ -0,0 +1,9 @@
+#pragma once
+
+namespace firefly::kernel::mm::bench {
+// Boot-time micro benchmarks for the memory manager.
+// They allocate and release real memory, keep them disabled unless you are measuring something.
+static constexpr bool enabled{};
+
+void run();
+}  // namespace firefly::kernel::mm::bench
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "firefly/memory-manager/mm.hpp"
+
+namespace firefly::kernel::mm {
+
+// All RAM of the memory map is mapped at AddressLayout::High, the higher half direct map (see kernelPageSpace::init()).
+// The bootloader sets up the same mapping, so it can be used before the kernel's page tables are loaded.
+// Memory handed out by the physical memory manager is addressed through it, page table entries and CR3 hold physical addresses.
+static constexpr uint64_t direct_map_offset = AddressLayout::High;
+
+template <typename T = void>
+inline T *phys_to_virt(uint64_t phys) {
+    return reinterpret_cast<T *>(phys + direct_map_offset);
+}
+
+inline uint64_t virt_to_phys(const void *virt) {
+    return reinterpret_cast<uint64_t>(virt) - direct_map_offset;
+}
+}  // namespace firefly::kernel::mm
@@ -4,7 +4,8 @@
 
 enum AddressLayout : uint64_t {
     PageData = 0xFFFFD00000000000UL,
-    High = 0xFFFF800000000000UL,
+    Vmalloc = 0xFFFFC00000000000UL,  // Up to PageData, see vmalloc()
+    High = 0xFFFF800000000000UL,     // Direct map of physical memory, up to Vmalloc
     Code = 0xFFFFFFFF80000000UL,
     Low = 0x0000000000000000UL
 };
@@ -14,6 +15,11 @@ static constexpr uint32_t PAGE_SHIFT = 12;  // Lower 12 bits of a virtual addres
 using PhysicalAddress = void *;
 using VirtualAddress = void *;
 
+struct PhysicalRange {
+    uint64_t base;
+    uint64_t length;
+};
+
 enum FillMode : char {
     ZERO = 0,
     NONE = 1  // Don't fill
@@ -4,92 +4,190 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <atomic>
 #include <utility>
 
+#include "cstdlib/cstring.h"
 #include "firefly/compiler/clang++.hpp"
+#include "firefly/logger.hpp"
+#include "firefly/memory-manager/hhdm.hpp"
 #include "firefly/memory-manager/mm.hpp"
 #include "firefly/stivale2.hpp"
 #include "libk++/bits.h"
 
-static constexpr uint64_t GLOB_PAGE_ARRAY = AddressLayout::PageData + MiB(512);
+// The page array is indexed by page frame number and starts at the beginning of the PageData region.
+// It is virtually contiguous but only the parts describing usable memory are backed, see Pagelist::init().
+static constexpr uint64_t GLOB_PAGE_ARRAY = AddressLayout::PageData;
 
-enum class RawPageFlags : int {
+enum class RawPageFlags : uint8_t {
     None = 0,
     Unusable = 1,
-    Slab = 2
+    Slab = 2,
+    ObjectSlab = 3  // Slab of an ObjectCache<T>, RawPage::slab points to its header
 };
 
-struct RawPage {
-    RawPageFlags flags;
-    int order;
-    int buddy_index;
-    std::atomic_int refcount;
+// Invoke 'func(base, length)' on every usable range of physical memory in ascending order.
+// These are the usable entries of the memory map plus 'early', the region the early boot allocator took out of the map
+// before the physical memory manager was set up (see core::paging::init_early_allocator()). It is reported on its own,
+// the entry it was taken from may have been moved up since, i.e. by metadata carved from its base.
+template <typename Func>
+inline void for_each_usable_range(const stivale2_struct_tag_memmap *mmap, PhysicalRange early, Func &&func) {
+    bool early_done = early.length == 0;
+
+    for (size_t i = 0; i < mmap->entries; i++) {
+        const auto *e = &mmap->memmap[i];
+        if (e->type != STIVALE2_MMAP_USABLE || e->length < PAGE_SIZE)
+            continue;
+
+        if (!early_done && early.base < e->base) {
+            func(early.base, early.length);
+            early_done = true;
+        }
 
-    void operator=(const RawPage &other) {
-        flags = other.flags;
-        order = other.order;
-        buddy_index = other.buddy_index;
-        refcount.store(other.refcount, std::memory_order_seq_cst);
+        func(e->base, e->length);
     }
 
+    if (!early_done)
+        func(early.base, early.length);
+}
+
+namespace firefly::kernel::mm {
+struct Slab;
+}
+
+// Describes one page frame.
+// Blocks handed out by the buddy allocators are compound: Only the head page (the first page of the block)
+// has its order, refcount and buddy_index set. Tail pages are left untouched and keep order 0.
+// Pages of a slab are the exception, all of them are flagged RawPageFlags::Slab (or ObjectSlab) and point to the slab's header.
+struct RawPage {
+    std::atomic_int refcount;
+    uint16_t buddy_index;
+    RawPageFlags flags;
+    uint8_t order;
+    firefly::kernel::mm::Slab *slab;
+
     bool is_buddy_page(int min_order) const {
         return order >= min_order;
     }
     void reset(bool reset_refcount = true) {
         flags = RawPageFlags::None;
         order = 0;
+        slab = nullptr;
         if (likely(reset_refcount))
-            refcount = 0;
+            refcount.store(0, std::memory_order_relaxed);
     }
-} PACKED;
+};
+
+// Descriptors must tile a page exactly and never straddle a cache line.
+static_assert(sizeof(RawPage) == 16 && alignof(RawPage) == 8, "RawPage layout changed");
 
 class Pagelist {
-    using Index = int;
+    using Index = uint64_t;
     using AddressType = uint64_t;
 
 public:
-    void init(stivale2_struct_tag_memmap *memmap_response) {
-        for (size_t i = 0; i < memmap_response->entries; i++) {
-            auto *e = &memmap_response->memmap[i];
-            for (size_t j = 0; j <= e->length; j += 4096, largest_index++) {
-                // clang-format off
-                auto const page = RawPage
-         		{
-                    .flags = (e->type != STIVALE2_MMAP_USABLE) ? RawPageFlags::Unusable : RawPageFlags::None
-                };
-                pages[largest_index] = page;
-                // clang-format on
+    static constexpr uint64_t descriptors_per_page = PAGE_SIZE / sizeof(RawPage);
+
+    Pagelist() = default;
+
+    // Place the page array at 'array_base' instead of GLOB_PAGE_ARRAY. (Used by the hosted tests)
+    explicit Pagelist(uint64_t array_base)
+        : pages(reinterpret_cast<RawPage *>(array_base)) {
+    }
+
+    // Determine which pages of the page array describe usable memory and reserve physical memory to back them.
+    // 'early' is usable memory which isn't part of the memory map (see for_each_usable_range()).
+    // Nothing is written to the array yet, the caller maps the runs (see for_each_run()) and calls populate() afterwards.
+    void init(stivale2_struct_tag_memmap *memmap_response, PhysicalRange early = {}) {
+        num_runs = 0;
+
+        // Ranges are sorted by their base address and don't overlap (stivale2 guarantees this),
+        // so an array page shared by two neighbouring ranges is always the last page of the previous run.
+        for_each_usable_range(memmap_response, early, [&](uint64_t base, uint64_t length) {
+            auto first = array_page_of(base);
+            const auto last = array_page_of(base + length - 1);
+
+            if (num_runs > 0) {
+                auto &prev = runs[num_runs - 1];
+                const auto prev_end = array_page_of_virt(prev.virt) + prev.length / PAGE_SIZE;
+
+                first = std::max(first, prev_end);
+                if (first > last)
+                    return;
+
+                if (first == prev_end) {
+                    prev.length += (last - first + 1) * PAGE_SIZE;
+                    return;
+                }
             }
+
+            assert_truth(num_runs < max_runs && "Too many discontiguous memory regions for the pagelist");
+            runs[num_runs++] = { .virt = array_base() + first * PAGE_SIZE, .phys = 0, .length = (last - first + 1) * PAGE_SIZE };
+        });
+
+        uint64_t backing_size = 0;
+        for (Index i = 0; i < num_runs; i++)
+            backing_size += runs[i].length;
+
+        auto backing = reserve_backing(memmap_response, backing_size);
+        for (Index i = 0; i < num_runs; i++) {
+            runs[i].phys = backing;
+            backing += runs[i].length;
         }
 
         firefly::kernel::info_logger << firefly::kernel::info_logger.format("RawPage size: %d bytes\n", sizeof(RawPage));
-        firefly::kernel::info_logger << firefly::kernel::info_logger.format("Pagelist overhead: %d Bytes\n", largest_index * sizeof(RawPage));
+        firefly::kernel::info_logger << firefly::kernel::info_logger.format("Pagelist overhead: %d Bytes in %d runs\n", backing_size, num_runs);
+    }
+
+    // Initialize every backed descriptor. Requires the runs to be mapped.
+    void populate(stivale2_struct_tag_memmap *memmap_response) {
+        for (Index i = 0; i < num_runs; i++)
+            memset(reinterpret_cast<void *>(runs[i].virt), 0, runs[i].length);
 
-        // largest_index is incremented one too many times.
-        --largest_index;
+        // Backed array pages may describe a few frames of neighbouring reserved entries.
+        for (size_t i = 0; i < memmap_response->entries; i++) {
+            const auto *e = &memmap_response->memmap[i];
+            if (e->type == STIVALE2_MMAP_USABLE)
+                continue;
+
+            for (Index j = 0; j < num_runs; j++) {
+                const auto run_base = array_page_of_virt(runs[j].virt) * descriptors_per_page * PAGE_SIZE;
+                const auto run_end = run_base + (runs[j].length / sizeof(RawPage)) * PAGE_SIZE;
+
+                const auto top = std::min(e->base + e->length, run_end);
+                for (auto addr = std::max(e->base, run_base); addr < top; addr += PAGE_SIZE)
+                    phys_to_page(addr)->flags = RawPageFlags::Unusable;
+            }
+        }
     }
 
-    inline auto get_page(RawPage *p) const {
-        return AddressType(pages - p);
+    // Invoke 'func(virtual, physical, length)' for every backed part of the page array.
+    template <typename Func>
+    void for_each_run(Func &&func) const {
+        for (Index i = 0; i < num_runs; i++)
+            func(runs[i].virt, runs[i].phys, runs[i].length);
     }
-    inline auto max_page() const {
-        return &pages[largest_index];
+
+    inline AddressType get_page(const RawPage *p) const {
+        return AddressType(p - pages);
     }
-    inline auto min_page() const {
-        return &pages[0];
+
+    inline RawPage *phys_to_page(uint64_t addr) const {
+        return &pages[addr >> PAGE_SHIFT];
     }
 
-    inline auto phys_to_page(uint64_t addr) const {
-        return &pages[(addr >> PAGE_SHIFT) - 1];
+    // Descriptor of the page 'ptr' (an address in the direct map) points into.
+    inline RawPage *virt_to_page(const void *ptr) const {
+        return phys_to_page(firefly::kernel::mm::virt_to_phys(ptr));
     }
 
-    inline auto page_to_phys(RawPage *p) const {
+    inline AddressType page_to_phys(const RawPage *p) const {
         return get_page(p) << PAGE_SHIFT;
     }
 
-    auto operator[](Index i) const {
-        auto const &page = phys_to_page(i);
+    auto operator[](Index pfn) const {
+        auto const &page = &pages[pfn];
         return array_operator{ .page = page, .address = page_to_phys(page) };
     }
 
@@ -99,9 +197,49 @@ private:
         AddressType address;
     };
 
+    // A virtually contiguous part of the page array and the physically contiguous memory backing it.
+    struct Run {
+        AddressType virt;
+        AddressType phys;
+        uint64_t length;
+    };
+
+    static inline Index array_page_of(uint64_t addr) {
+        return (addr >> PAGE_SHIFT) / descriptors_per_page;
+    }
+
+    inline Index array_page_of_virt(AddressType virt) const {
+        return (virt - array_base()) / PAGE_SIZE;
+    }
+
+    inline AddressType array_base() const {
+        return reinterpret_cast<AddressType>(pages);
+    }
+
+    inline AddressType reserve_backing(stivale2_struct_tag_memmap *mmap, uint64_t size) {
+        for (size_t i = 0; i < mmap->entries; i++) {
+            auto *e = &mmap->memmap[i];
+            if (e->type != STIVALE2_MMAP_USABLE || e->length < size)
+                continue;
+
+            firefly::kernel::info_logger << firefly::kernel::info_logger.format("Creating %d large hole at region [0x%x-0x%x]\n", size, e->base, e->base + e->length);
+            auto base = e->base;
+            e->base += size;
+            e->length -= size;
+            return base;
+        }
+
+        assert_truth(!"Failed to reserve memory for the pagelist!");
+        __builtin_unreachable();
+    }
+
+private:
+    static constexpr Index max_runs = 128;
+
     RawPage *pages = (struct RawPage *)GLOB_PAGE_ARRAY;
-    Index largest_index{};  // largest index into the 'pages' array
+    Run runs[max_runs];
+    Index num_runs{};
 };
 
-// Instance created in primary_phys.cpp
-extern Pagelist pagelist;
\ No newline at end of file
+// Instance created in page.cpp
+extern Pagelist pagelist;
@@ -12,6 +12,7 @@
 #include "cstdlib/cassert.h"
 #include "cstdlib/cstring.h"
 #include "firefly/logger.hpp"
+#include "firefly/memory-manager/hhdm.hpp"
 #include "firefly/memory-manager/page.hpp"
 #include "libk++/align.h"
 
@@ -43,23 +44,92 @@ public:
 
     Order max_order = 0;                                // Represents the largest allocation and is determined at runtime.
     constexpr static Order min_order = 9;               // 4kib, this is the smallest allocation size and will never change.
-    constexpr static Order largest_allowed_order = 30;  // 1GiB is the largest allocation an instance of this class may serve.
+    constexpr static Order largest_allowed_order = 37;  // 1TiB is the largest zone (and allocation) an instance of this class may serve.
     constexpr static bool verbose{}, sanity_checks{};   // sanity_checks ensures we don't go out-of-bounds on the freelist.
                                                         // Beware: These options will impact the performance of the allocator.
 
-    void init(AddressType base, int target_order) {
-        this->base = base;
+    // Number of blocks of 'order' overlapping [base, base + length), the free map of that order has one bit for each.
+    static constexpr uint64_t map_blocks(uint64_t base, uint64_t length, Order order) {
+        return ((base + length - 1) >> (order + 3)) - (base >> (order + 3)) + 1;
+    }
+
+    // Number of 64-bit words the free map of an allocator managing [base, base + length) occupies.
+    static constexpr uint64_t free_map_words(uint64_t base, uint64_t length) {
+        uint64_t words = 0;
+        for (Order ord = min_order; ord <= window_order(base, base + length) - 3; ord++)
+            words += (map_blocks(base, length, ord) + 63) / 64;
+
+        return words;
+    }
+
+    // Smallest order able to hold 'size' bytes.
+    static constexpr Order order_of(uint64_t size) {
+        Order order = min_order;
+        while ((1ull << (order + 3)) < size)
+            ++order;
+
+        return order;
+    }
+
+    // Byte order of the smallest naturally aligned power-of-two window containing [base, end).
+    static constexpr int window_order(uint64_t base, uint64_t end) {
+        int order = PAGE_SHIFT;
+        while ((base >> order) != ((end - 1) >> order))
+            ++order;
+
+        return order;
+    }
+
+    // Manage the usable range [base, base + length), both of which must be page aligned.
+    // The allocator spans the naturally aligned window around the range so that every block it hands out is
+    // naturally aligned. Memory inside the window but outside of the range is treated as reserved and is never
+    // put on a freelist, so it can't be merged with (or allocated) either.
+    // The free maps only cover the blocks overlapping the range, not the whole window.
+    // Nothing is free until (parts of) the range are passed to free_range().
+    void init(uint64_t base, uint64_t length, uint64_t *free_map_storage) {
+        const auto target_order = window_order(base, base + length);
+        zone_base = base;
+        zone_length = length;
+        this->base = reinterpret_cast<AddressType>(base & ~((1ull << target_order) - 1));
         max_order = target_order - 3;
 
         if constexpr (verbose)
             firefly::kernel::info_logger << firefly::kernel::info_logger.format("min-order: %d, max-order: %d", min_order, max_order);
 
+        // Carve one bitmap per order out of the storage handed to us by the BuddyManager
+        for (Order ord = min_order; ord <= max_order; ord++) {
+            free_map[ord - min_order] = free_map_storage;
+            first_block[ord - min_order] = base >> (ord + 3);
+            num_blocks[ord - min_order] = map_blocks(base, length, ord);
+            free_map_storage += (num_blocks[ord - min_order] + 63) / 64;
+        }
+        memset(static_cast<void *>(free_map[0]), 0, free_map_words(base, length) * sizeof(uint64_t));
+
         freelist.init();
-        freelist.add(base, max_order - min_order);
+        free_orders = 0;
+        free_page_count = splits = merges = 0;
+        for (auto &count : free_blocks)
+            count = 0;
+    }
+
+    // Put [base, base + length) on the freelists, it must be page aligned and lie within the usable range.
+    // The range is carved into the largest naturally aligned blocks that fit, no two of which are buddies.
+    // Each block is merged with its buddy if that is free already, so freeing ranges piecemeal ends up fully coalesced too.
+    void free_range(uint64_t base, uint64_t length) {
+        assert_truth(base >= zone_base && base + length <= zone_base + zone_length && "Range is not part of this zone");
+
+        for (uint64_t addr = base, end = base + length; addr < end;) {
+            Order ord = std::min(max_order, (addr ? __builtin_ctzll(addr) : 63) - 3);
+            while ((1ull << (ord + 3)) > end - addr)
+                --ord;
+
+            coalesce(reinterpret_cast<AddressType>(addr), ord);
+            addr += (1ull << (ord + 3));
+        }
     }
 
     auto alloc(uint64_t size, FillMode fill = FillMode::ZERO) {
-        Order order = std::max(min_order, log2(size >> 3));
+        Order order = order_of(size);
 
         if constexpr (sanity_checks) {
             if (order > max_order) {
@@ -77,7 +147,7 @@ public:
         Order ord = order;
 
         for (; ord <= max_order; ord++) {
-            block = freelist.remove(ord - min_order);
+            block = pop(ord);
             if (block != nullptr)
                 break;
         }
@@ -92,11 +162,12 @@ public:
         // Split higher order blocks
         while (ord-- > order) {
             auto buddy = buddy_of(block, ord);
-            freelist.add(buddy, ord - min_order);
+            push(buddy, ord);
+            splits++;
         }
 
         // 'size' is not guaranteed to be a power of two. (Hence the manual pow2)
-        const auto correct_size = (1 << (order + 3));
+        const auto correct_size = (1ull << (order + 3));
 
         if (fill != FillMode::NONE)
             memset(static_cast<void *>(block), fill, correct_size);
@@ -107,33 +178,109 @@ public:
         return BuddyAllocationResult(block, ord + 1, correct_size / PAGE_SIZE);
     }
 
+    // Allocate up to 'count' blocks of 'order' into 'out' and return how many were allocated. (No fill)
+    // Blocks are popped straight off the freelist of 'order'. Once it runs dry, a single larger block is taken
+    // and cut into as many blocks as are still needed, only the unused remainder goes back onto the freelists.
+    uint64_t alloc_bulk(Order order, PhysicalAddress *out, uint64_t count) {
+        uint64_t n = 0;
+
+        while (n < count) {
+            AddressType block = pop(order);
+            if (block != nullptr) {
+                out[n++] = block;
+                continue;
+            }
+
+            Order ord = order + 1;
+            for (; ord <= max_order && block == nullptr; ord++)
+                block = pop(ord);
+
+            if (block == nullptr)
+                break;
+            ord--;
+
+            const uint64_t pieces = 1ull << (ord - order), taken = std::min(pieces, count - n);
+            const uint64_t block_size = 1ull << order;  // In words, AddressType is a uint64_t *
+            for (uint64_t i = 0; i < taken; i++)
+                out[n++] = block + i * block_size;
+
+            // Return the remainder as the largest naturally aligned blocks that fit, like init() does.
+            uint64_t produced = taken;
+            for (auto addr = block + taken * block_size, end = block + (1ull << ord); addr < end; produced++) {
+                Order rem = std::min<Order>(ord - 1, __builtin_ctzll(static_cast<uint64_t>(addr - base)));
+                while (addr + (1ull << rem) > end)
+                    --rem;
+
+                push(addr, rem);
+                addr += 1ull << rem;
+            }
+
+            splits += produced - 1;
+        }
+
+        return n;
+    }
+
     void free(AddressType block, Order order) {
         assert_truth(order >= min_order && order <= max_order && "Invalid order passed to free()");
         if (block == nullptr)
             return;
 
-        // There are no buddies at max_order
-        if (order == max_order) {
-            freelist.add(block, max_order - min_order);
-            return;
-        }
-
         coalesce(block, order);
     }
 
-    int log2(int size) {
-        int result = 0;
-        while ((1 << result) < size) {
-            ++result;
-        }
-        return result;
+    // Bit 'n' is set while a block of order 'min_order + n' is free.
+    inline uint64_t free_order_mask() const {
+        return free_orders;
+    }
+
+    // Statistics, see Physical::stats()
+    inline uint64_t free_block_count(Order order) const {
+        return free_blocks[order - min_order];
+    }
+
+    inline uint64_t free_bytes() const {
+        uint64_t bytes = 0;
+        for (Order ord = min_order; ord <= max_order; ord++)
+            bytes += free_blocks[ord - min_order] << (ord + 3);
+
+        return bytes;
+    }
+
+    // Same as free_bytes() / PAGE_SIZE, but kept up to date on every operation instead of being summed up.
+    inline uint64_t free_pages() const {
+        return free_page_count;
+    }
+
+    inline uint64_t split_count() const {
+        return splits;
+    }
+
+    inline uint64_t merge_count() const {
+        return merges;
+    }
+
+    // The usable range passed to init()
+    inline uint64_t range_base() const {
+        return zone_base;
+    }
+
+    inline uint64_t range_length() const {
+        return zone_length;
     }
 
 private:
+    // Freelists are intrusive, the node of a free block is stored in its first 16 bytes.
+    // Being doubly-linked allows any block (i.e. a buddy that is about to be merged) to be unlinked in O(1).
+    struct FreeBlock {
+        FreeBlock *next;
+        FreeBlock *prev;
+    };
+
     template <typename T, int orders>
     class Freelist {
     private:
-        T list[orders + 1]{ nullptr };
+        FreeBlock *list[orders + 1]{ nullptr };
 
     public:
         void init() {
@@ -143,128 +290,250 @@ private:
 
         void add(const T &block, Order order) {
             if constexpr (sanity_checks)
-                if (order < min_order || order > largest_allowed_order)
+                if (order < 0 || order > orders)
                     assert_truth(!"Order mismatch");
 
-            if (block) {
-                memset((void *)block, 0, PAGE_SIZE);
-                *(T *)block = list[order];
-            }
-            list[order] = block;
+            auto node = reinterpret_cast<FreeBlock *>(block);
+            node->prev = nullptr;
+            node->next = list[order];
+
+            if (list[order])
+                list[order]->prev = node;
+            list[order] = node;
         }
 
         T remove(Order order) {
             if constexpr (sanity_checks)
-                if (order < min_order || order > largest_allowed_order)
+                if (order < 0 || order > orders)
                     assert_truth(!"Order mismatch");
 
-            T element = list[order];
+            auto node = list[order];
 
-            if (element == nullptr)
+            if (node == nullptr)
                 return nullptr;
 
-            list[order] = *(T *)list[order];
-            return element;
-        }
+            list[order] = node->next;
+            if (node->next)
+                node->next->prev = nullptr;
 
-        T next(const T &block) const {
-            return *reinterpret_cast<T *>(block);
+            return reinterpret_cast<T>(node);
         }
 
-        bool find(const T &block, Order order) const {
-            T element = list[order];
-            while (element != nullptr && element != block) {
-                element = next(element);
-            }
+        // Remove a specific block from the list.
+        // Only called once the free map confirmed that 'block' is on this list.
+        void unlink(const T &block, Order order) {
+            auto node = reinterpret_cast<FreeBlock *>(block);
 
-            return element != nullptr;
+            if (node->prev)
+                node->prev->next = node->next;
+            else
+                list[order] = node->next;
+
+            if (node->next)
+                node->next->prev = node->prev;
+        }
+
+        bool empty(Order order) const {
+            return list[order] == nullptr;
         }
     };
 
     inline AddressType buddy_of(AddressType block, Order order) {
-        return base + ((block - base) ^ (1 << order));
+        return base + ((block - base) ^ (1ull << order));
+    }
+
+    // Free map helpers, one bit per block and order. A set bit means the block is on the freelist.
+    // Bits are indexed from the first block overlapping the usable range, the free map of each order starts there.
+    inline uint64_t block_index(AddressType block, Order order) const {
+        return (reinterpret_cast<uint64_t>(block) >> (order + 3)) - first_block[order - min_order];
+    }
+
+    // The buddy of a block at the edge of the range may lie outside of it (and its free map), it is never free.
+    inline bool is_free(AddressType block, Order order) const {
+        auto idx = block_index(block, order);
+        if (idx >= num_blocks[order - min_order])
+            return false;
+
+        return free_map[order - min_order][idx / 64] & (1ull << (idx % 64));
+    }
+
+    inline void set_free(AddressType block, Order order, bool state) {
+        auto idx = block_index(block, order);
+        if constexpr (sanity_checks)
+            assert_truth(idx < num_blocks[order - min_order] && "Block is outside of the free map");
+
+        auto &word = free_map[order - min_order][idx / 64];
+
+        if (state)
+            word |= (1ull << (idx % 64));
+        else
+            word &= ~(1ull << (idx % 64));
+    }
+
+    inline void push(AddressType block, Order order) {
+        freelist.add(block, order - min_order);
+        set_free(block, order, true);
+        free_orders |= (1ull << (order - min_order));
+        free_blocks[order - min_order]++;
+        free_page_count += 1ull << (order - min_order);
+    }
+
+    inline AddressType pop(Order order) {
+        AddressType block = freelist.remove(order - min_order);
+        if (block != nullptr) {
+            set_free(block, order, false);
+            free_blocks[order - min_order]--;
+            free_page_count -= 1ull << (order - min_order);
+            if (freelist.empty(order - min_order))
+                free_orders &= ~(1ull << (order - min_order));
+        }
+
+        return block;
     }
 
     void coalesce(AddressType block, Order order) {
         // Description:
         // Try to merge 'block' and it's buddy into one larger block at 'order + 1'
-        // If both block are free, remove them and insert the smaller of
-        // the two blocks into the next highest order and repeat that process.
-        if (order == max_order)
-            return;
-
-        AddressType buddy = buddy_of(block, order);
-        if (buddy == nullptr)
-            return;
-
-        // Scan freelist for the buddy. (This isn't really efficient)
-        // Could be optimized with a bitmap to track the state of each node.
-        // The overhead of a bitmap would be minimal + the allocator itself has little to no overhead so size complexity should not be of concern.
-        bool is_buddy_free = freelist.find(buddy, order - min_order);
+        // If both blocks are free, take the buddy off its freelist and repeat
+        // the process with the smaller of the two blocks at the next highest order.
+        // Checking the state of the buddy is a single bit test, the free map is kept in sync by push() and pop().
+        for (; order < max_order; order++) {
+            AddressType buddy = buddy_of(block, order);
+
+            // The buddy is in use and merging is not possible.
+            if (!is_free(buddy, order))
+                break;
 
-        // Buddy block is free, merge them together
-        if (is_buddy_free) {
-            freelist.remove(order);
-            coalesce(std::min(block, buddy), order + 1);  // std::min ensures that the smaller block of memory is merged with a larger and not vice-versa (which wouldn't work)
+            freelist.unlink(buddy, order - min_order);
+            set_free(buddy, order, false);
+            free_blocks[order - min_order]--;
+            free_page_count -= 1ull << (order - min_order);
+            merges++;
+            if (freelist.empty(order - min_order))
+                free_orders &= ~(1ull << (order - min_order));
+            block = std::min(block, buddy);  // std::min ensures that the smaller block of memory is merged with a larger and not vice-versa (which wouldn't work)
         }
 
-        // The buddy is not free and merging is not possible.
-        // Therefore it is simply put back onto the freelist.
-        freelist.add(block, order - min_order);
+        push(block, order);
     }
 
 private:
     Freelist<AddressType, largest_allowed_order - min_order> freelist;
+    uint64_t *free_map[largest_allowed_order - min_order + 1]{ nullptr };
+    uint64_t first_block[largest_allowed_order - min_order + 1]{};  // Index of the first block of each free map
+    uint64_t num_blocks[largest_allowed_order - min_order + 1]{};   // Number of bits in each free map
+    uint64_t free_orders{};
     AddressType base{};
+
+    uint64_t free_blocks[largest_allowed_order - min_order + 1]{};  // Number of blocks on each freelist
+    uint64_t free_page_count{};
+    uint64_t splits{}, merges{};
+    uint64_t zone_base{}, zone_length{};
 };
 
+// The zones are handed their memory through the direct map: Blocks (and the freelist nodes inside of them) are
+// addressed by their direct map address, only init() and free_range() take physical addresses.
 class BuddyManager {
     using AddressType = BuddyAllocator::AddressType;
     using Index = uint64_t;
 
 public:
-    void init(struct stivale2_struct_tag_memmap *memmap_response) {
+    static constexpr Index max_zones = 512;
+
+    // Free page thresholds of all zones together: The physical memory manager starts reclaiming memory from kernel
+    // caches once free memory drops below 'low' and asks them for enough to get back to 'high'.
+    struct Watermarks {
+        uint64_t low;
+        uint64_t high;
+    };
+
+    // 'early' is the early boot allocator's region (see for_each_usable_range()). It gets a zone of its own which starts
+    // out empty, the early allocator hands whatever it didn't use to free_range() once it retires.
+    void init(struct stivale2_struct_tag_memmap *memmap_response, PhysicalRange early = {}) {
         highest_address = memmap_response->memmap[memmap_response->entries - 1].base + memmap_response->memmap[memmap_response->entries - 1].length;
 
-        sort(memmap_response);
-        auto num_buddies = reserve_buddy_allocator_memory(memmap_response);
+        auto num_buddies = reserve_buddy_allocator_memory(memmap_response, early);
         memset(static_cast<void *>(buddies), 0, sizeof(BuddyAllocator) * num_buddies);
 
         Index idx{};
         uint64_t total{};
-        for (Index i = 0; i < memmap_response->entries; i++) {
-            auto *e = &memmap_response->memmap[i];
-            if (e->type != STIVALE2_MMAP_USABLE || e->length <= PAGE_SIZE)
-                continue;
-
-            for (uint64_t j = 0; j < 64; j++) {
-                if (e->length & (1ll << j)) {
-                    auto top = e->base + (1ll << j);
-                    auto size_bytes = top - e->base;
-                    buddies[idx++].init((uint64_t *)e->base, log2(size_bytes));
-                    e->base += (1ll << j);
-                    total += (1ll << j);
-                }
-            }
-        }
+        for_each_usable_range(memmap_response, early, [&](uint64_t range_base, uint64_t range_length) {
+            const bool is_early = range_base == early.base && early.length != 0;
+
+            // One zone per region, unless the region exceeds the largest zone an allocator can manage.
+            split_zones(range_base, range_length, [&](uint64_t base, uint64_t length) {
+                // The direct map offset is aligned far beyond the largest zone, blocks stay naturally aligned.
+                const auto virt = reinterpret_cast<uint64_t>(firefly::kernel::mm::phys_to_virt(base));
+                buddies[idx].init(virt, length, free_map_pool);
+                if (!is_early)
+                    buddies[idx].free_range(virt, length);
+
+                free_map_pool += BuddyAllocator::free_map_words(base, length);
+                total += length;
+                idx++;
+            });
+        });
         top_idx = idx - 1;
+        num_zones = idx;
+        assert_truth(idx <= num_buddies && free_map_pool <= free_map_end && "Buddy allocator metadata overflowed its reserved memory");
+        assert_truth(idx <= max_buddies && "Too many buddy allocators to index");
 
-        // Iterate over elements in the base array
+        free_page_count = 0;
         for (Index i = 0; i < idx; i++) {
-            // Sort the elements by swapping them where applicable.
-            [&]() {
-                auto &original = buddies[i];
+            update_index(i, 0);
+            free_page_count += buddies[i].free_pages();
+        }
+
+        // Scale with memory, 1GiB keeps 2-4MiB free.
+        watermark_pages.low = std::clamp<uint64_t>(total / PAGE_SIZE / 512, min_watermark, max_watermark);
+        watermark_pages.high = 2 * watermark_pages.low;
 
-                for (Index j = i + 1; j < idx; j++) {
-                    auto &current = buddies[j];
+        const auto largest_order = largest_free_order();
 
-                    if (current.max_order > original.max_order)
-                        std::swap(current, original);
-                }
-            }();
+        firefly::kernel::info_logger << firefly::kernel::info_logger.format("Managing a grand total of: %d bytes in %d zones\n", total, idx);
+        firefly::kernel::info_logger << firefly::kernel::info_logger.format("Largest allocatable order: %d (%d KiB)\n", largest_order, (1ull << (largest_order + 3)) >> 10);
+    }
+
+    // Hand the physical range [base, base + length) to the zone which manages it, i.e. memory that was in use since boot.
+    void free_range(uint64_t phys_base, uint64_t length) {
+        const auto base = reinterpret_cast<uint64_t>(firefly::kernel::mm::phys_to_virt(phys_base));
+
+        for (Index i = 0; i < num_zones; i++) {
+            const auto &zone = buddies[i];
+            if (base < zone.range_base() || base >= zone.range_base() + zone.range_length())
+                continue;
+
+            const auto free_orders = zone.free_order_mask();
+            buddies[i].free_range(base, length);
+            update_index(i, free_orders);
+            free_page_count += length / PAGE_SIZE;
+            return;
         }
 
-        firefly::kernel::info_logger << firefly::kernel::info_logger.format("Managing a grand total of: %d bytes\n", total);
+        assert_truth(!"free_range(): Range is not managed by any zone");
+    }
+
+    // Largest order any of the buddies can currently allocate, or -1 if all of them are exhausted.
+    BuddyAllocator::Order largest_free_order() const {
+        return available_orders ? (63 - __builtin_clzll(available_orders)) + BuddyAllocator::min_order : -1;
+    }
+
+    // Number of zones (one BuddyAllocator each) and read access to them, i.e. for statistics.
+    Index zone_count() const {
+        return num_zones;
+    }
+
+    const BuddyAllocator &zone(Index i) const {
+        return buddies[i];
+    }
+
+    // Free pages of all zones together, kept up to date on every operation.
+    uint64_t free_pages() const {
+        return free_page_count;
+    }
+
+    const Watermarks &watermarks() const {
+        return watermark_pages;
     }
 
     // Returns the highest address in the memory map.
@@ -282,99 +551,161 @@ public:
     }
 
     AddressType alloc(uint64_t size, FillMode fill = FillMode::NONE) {
-        BuddyAllocator::Order order = log2(size);
-        Index min_idx = suitable_buddy(order);
-
-        // Buddy allocators are sorted from the largest to smallest order
-        for (Index i = min_idx; i > 0; i--) {
-            // Perform the allocation
-            auto ptr = buddies[i].alloc(size, fill);
-
-            if (ptr.unpack()) {
-                // Mark the allocated pages as such in the pagelist
-                auto npages = ptr.npages;
-                auto base = reinterpret_cast<uint64_t>(ptr.unpack());
-
-                for (int j = 0; j < npages; j++, base += PAGE_SIZE) {
-                    auto page = pagelist.phys_to_page(base);
-                    page->refcount++;
-                    page->order = ptr.order;
-                    page->buddy_index = i;
-                }
-
-                return ptr.unpack();
+        const auto order = BuddyAllocator::order_of(size);
+        const Index i = suitable_buddy(order);
+
+        if (i == no_buddy)
+            return nullptr;
+
+        // Perform the allocation, the index guarantees that this buddy has a large enough block.
+        const auto free_orders = buddies[i].free_order_mask();
+        auto ptr = buddies[i].alloc(size, fill);
+        update_index(i, free_orders);
+
+        if (!ptr.unpack())
+            return nullptr;
+        free_page_count -= ptr.npages;
+
+        // Mark the block as allocated in the pagelist.
+        // Only the head page carries the state of a block, its tail pages keep order 0 and are never touched,
+        // which makes this O(1) regardless of the size of the allocation.
+        // Relaxed ordering suffices, nobody else can hold a reference to a block that was just taken off a freelist.
+        auto page = pagelist.virt_to_page(ptr.unpack());
+        page->refcount.store(1, std::memory_order_relaxed);
+        page->order = ptr.order;
+        page->buddy_index = i;
+
+        return ptr.unpack();
+    }
+
+    // Allocate up to 'count' blocks of 'size' bytes into 'out', returns the number of blocks allocated.
+    // The buddy search and index update happen once per zone the blocks are taken from, rather than once per block.
+    uint64_t alloc_bulk(uint64_t size, PhysicalAddress *out, uint64_t count, FillMode fill = FillMode::NONE) {
+        const auto order = BuddyAllocator::order_of(size);
+        uint64_t n = 0;
+
+        while (n < count) {
+            const Index i = suitable_buddy(order);
+            if (i == no_buddy)
+                break;
+
+            const auto free_orders = buddies[i].free_order_mask();
+            const auto allocated = buddies[i].alloc_bulk(order, out + n, count - n);
+            update_index(i, free_orders);
+            free_page_count -= allocated << (order - BuddyAllocator::min_order);
+
+            for (auto block = out + n; block < out + n + allocated; block++) {
+                auto page = pagelist.virt_to_page(*block);
+                page->refcount.store(1, std::memory_order_relaxed);
+                page->order = order;
+                page->buddy_index = i;
+
+                if (fill != FillMode::NONE)
+                    memset(*block, fill, 1ull << (order + 3));
             }
+
+            n += allocated;
         }
 
-        return nullptr;
+        return n;
     }
 
-    void free(AddressType ptr) {
-        auto page = pagelist.phys_to_page(reinterpret_cast<uint64_t>(ptr));
+    // Free 'count' blocks. Consecutive blocks of the same zone share one index update.
+    void free_bulk(const PhysicalAddress *blocks, uint64_t count) {
+        Index zone = no_buddy;
+        uint64_t free_orders = 0;
 
-        // Not a buddy page
-        if (!page->is_buddy_page(BuddyAllocator::min_order))
-            return;
+        for (uint64_t n = 0; n < count; n++) {
+            const auto block = static_cast<AddressType>(blocks[n]);
+            auto page = pagelist.virt_to_page(block);
+            if (!release_head(page, block))
+                continue;
 
-        if (page->refcount == 0) {
-            firefly::kernel::info_logger << "Caught potential double-free: " << firefly::kernel::info_logger.hex(ptr) << firefly::kernel::logger::endl;
-            return;
+            if (page->buddy_index != zone) {
+                if (zone != no_buddy)
+                    update_index(zone, free_orders);
+
+                zone = page->buddy_index;
+                free_orders = buddies[zone].free_order_mask();
+            }
+
+            const int order = page->order;
+            page->reset();
+            buddies[zone].free(block, order);
+            free_page_count += 1ull << (order - BuddyAllocator::min_order);
         }
 
+        if (zone != no_buddy)
+            update_index(zone, free_orders);
+    }
+
+    void free(AddressType ptr) {
+        auto page = pagelist.virt_to_page(ptr);
+        if (!release_head(page, ptr))
+            return;
+
         // Save some data before the page gets reset.
         int buddy_index = page->buddy_index;
         int order = page->order;
+        page->reset();
 
+        const auto free_orders = buddies[buddy_index].free_order_mask();
+        buddies[buddy_index].free(ptr, order);
+        update_index(buddy_index, free_orders);
+        free_page_count += 1ull << (order - BuddyAllocator::min_order);
+    }
 
-        // Mark the pages in the pagelist as free and perform some checks
-        uint32_t npages = (1 << (page->order + 3)) / PAGE_SIZE;
-        auto base = reinterpret_cast<uint64_t>(ptr);
+private:
+    // Check that 'page' is the head of an allocated block which may be freed.
+    inline bool release_head(RawPage *page, AddressType ptr) const {
+        // Not the head page of a buddy block
+        if (!page->is_buddy_page(BuddyAllocator::min_order))
+            return false;
 
-        for (uint32_t i = 0; i < npages; i++, base += PAGE_SIZE) {
-            page = pagelist.phys_to_page(base);
-            assert_truth(page->refcount == 1 && "This pages refcount is not 1. This means that there was an attempt to free an actively used block of memory");
-            page->reset();
+        const auto refcount = page->refcount.load(std::memory_order_relaxed);
+        if (refcount == 0) {
+            firefly::kernel::info_logger << "Caught potential double-free: " << firefly::kernel::info_logger.hex(ptr) << firefly::kernel::logger::endl;
+            return false;
         }
+        assert_truth(refcount == 1 && "This pages refcount is not 1. This means that there was an attempt to free an actively used block of memory");
 
-        buddies[buddy_index].free(ptr, order);
+        return true;
     }
 
-private:
-    // Selection sort
-    inline void sort(stivale2_struct_tag_memmap *mmap) {
-        // Iterate over elements in the base array
-        for (uint64_t i = 0; i < mmap->entries; i++) {
-            // Sort the elements by swapping them where applicable.
-            [&]() {
-                auto *original = &mmap->memmap[i];
-
-                for (uint64_t j = i + 1; j < mmap->entries; j++) {
-                    auto *current = &mmap->memmap[j];
-                    if (current->length > original->length)
-                        std::swap(current, original);
-                }
-            }();
+    // Split [base, base + length) into zones no larger than the largest window a BuddyAllocator can manage
+    // and invoke 'func' on each of them. Virtually every region fits into a single zone.
+    template <typename Func>
+    static void split_zones(uint64_t base, uint64_t length, Func &&func) {
+        constexpr auto max_window = BuddyAllocator::largest_allowed_order + 3;
+
+        for (uint64_t end = base + length; base < end;) {
+            const uint64_t window_end = (base & ~((1ull << max_window) - 1)) + (1ull << max_window);
+            const auto zone_end = std::min(end, window_end);
+
+            func(base, zone_end - base);
+            base = zone_end;
         }
     }
 
-    inline uint64_t buddies_required(stivale2_struct_tag_memmap *mmap) {
-        uint64_t num_buddies_required = 0;
-        for (Index i = 0; i < mmap->entries; i++) {
-            const auto *e = &mmap->memmap[i];
-            if (e->type != STIVALE2_MMAP_USABLE || e->length <= PAGE_SIZE)
-                continue;
+    // Number of zones and free map words needed by all buddy allocators.
+    // Reserving the metadata moves the base of one region up, which never increases either of them.
+    inline void metadata_required(stivale2_struct_tag_memmap *mmap, PhysicalRange early, uint64_t &num_buddies, uint64_t &map_words) {
+        num_buddies = map_words = 0;
 
-            for (uint64_t j = 0; j < 64; j++)
-                if (e->length & (1LL << j))
-                    ++num_buddies_required;
-        }
+        for_each_usable_range(mmap, early, [&](uint64_t range_base, uint64_t range_length) {
+            split_zones(range_base, range_length, [&](uint64_t base, uint64_t length) {
+                num_buddies++;
+                map_words += BuddyAllocator::free_map_words(base, length);
+            });
+        });
 
-        assert_truth(num_buddies_required > 0ul && "Bad memory map?");
-        return num_buddies_required;
+        assert_truth(num_buddies > 0ul && "Bad memory map?");
     }
 
-    inline uint64_t reserve_buddy_allocator_memory(stivale2_struct_tag_memmap *mmap) {
-        const auto size = buddies_required(mmap) * sizeof(BuddyAllocator);
+    inline uint64_t reserve_buddy_allocator_memory(stivale2_struct_tag_memmap *mmap, PhysicalRange early) {
+        uint64_t num_buddies, map_words;
+        metadata_required(mmap, early, num_buddies, map_words);
+        const auto size = num_buddies * sizeof(BuddyAllocator) + map_words * sizeof(uint64_t);
 
         for (Index i = 0; i < mmap->entries; i++) {
             auto *e = &mmap->memmap[i];
@@ -382,38 +713,80 @@ private:
                 continue;
 
             firefly::kernel::info_logger << firefly::kernel::info_logger.format("Creating %d large hole at region [0x%x-0x%x]\n", size, e->base, e->base + e->length);
-            buddies = reinterpret_cast<BuddyAllocator *>(e->base);
-
-            e->base = firefly::libkern::align_up4k(e->base + size);
-            e->length -= firefly::libkern::align_down4k(size);
-            return (size / sizeof(BuddyAllocator));
+            buddies = firefly::kernel::mm::phys_to_virt<BuddyAllocator>(e->base);
+            free_map_pool = firefly::kernel::mm::phys_to_virt<uint64_t>(e->base + num_buddies * sizeof(BuddyAllocator));
+            free_map_end = free_map_pool + map_words;
+
+            auto top = firefly::libkern::align_up4k(e->base + size);
+            e->length -= top - e->base;
+            e->base = top;
+            return num_buddies;
         }
 
         assert_truth(!"Failed to reserve memory for the buddy allocators!");
         __builtin_unreachable();
     }
 
-    inline Index suitable_buddy(uint64_t suitable_order) {
-        Index suitable_index{};
-        for (Index i = 0; i < top_idx; i++) {
-            [&]() {
-                auto &original = buddies[i];
+    // Picks the buddy with the smallest free block that can satisfy 'order', which keeps splitting to a minimum.
+    // This boils down to three 'find first set' operations: One for the order, one for the word of the allocator bitmap and one for the allocator.
+    inline Index suitable_buddy(BuddyAllocator::Order order) {
+        if (order > BuddyAllocator::largest_allowed_order)
+            return no_buddy;
 
-                for (Index j = i + 1; j < top_idx; j++) {
-                    auto &current = buddies[j];
+        const auto mask = available_orders & ~((1ull << (order - BuddyAllocator::min_order)) - 1);
+        if (mask == 0)
+            return no_buddy;
+
+        const auto ord = __builtin_ctzll(mask);
+        const auto word = __builtin_ctzll(available_words[ord]);
+        return word * 64 + __builtin_ctzll(available[ord][word]);
+    }
 
-                    if (current.max_order < original.max_order && current.max_order >= static_cast<BuddyAllocator::Order>(suitable_order))
-                        suitable_index = j;
-                }
-            }();
+    // Bring the index up to date with the free orders of buddy 'i'.
+    // 'old_orders' is the free order mask of the buddy before the operation that changed it.
+    void update_index(Index i, uint64_t old_orders) {
+        const auto new_orders = buddies[i].free_order_mask();
+        auto changed = old_orders ^ new_orders;
+
+        while (changed) {
+            const auto ord = __builtin_ctzll(changed);
+            const auto word = i / 64;
+            changed &= changed - 1;
+
+            if (new_orders & (1ull << ord)) {
+                available[ord][word] |= (1ull << (i % 64));
+                available_words[ord] |= (1ull << word);
+                available_orders |= (1ull << ord);
+                continue;
+            }
+
+            available[ord][word] &= ~(1ull << (i % 64));
+            if (available[ord][word] == 0)
+                available_words[ord] &= ~(1ull << word);
+            if (available_words[ord] == 0)
+                available_orders &= ~(1ull << ord);
         }
-        return suitable_index;
     }
 
 private:
+    static constexpr Index max_buddies = max_zones;
+    static constexpr Index no_buddy = ~0ull;
+    static constexpr int orders = BuddyAllocator::largest_allowed_order - BuddyAllocator::min_order + 1;
+    static constexpr uint64_t min_watermark = 16, max_watermark = 8192;  // Pages, 64KiB - 32MiB
+
     uint64_t highest_address;
     BuddyAllocator *buddies;
-    Index top_idx{};
+    uint64_t *free_map_pool, *free_map_end;
+    Index top_idx{}, num_zones{};
+    uint64_t free_page_count{};
+    Watermarks watermark_pages{};
+
+    // Index of buddies with free blocks:
+    // available[ord] has bit 'i' set while buddy 'i' has a free block of order 'min_order + ord',
+    // available_words[ord] flags the non-zero words of available[ord] and available_orders flags the non-empty orders.
+    uint64_t available[orders][max_buddies / 64]{};
+    uint64_t available_words[orders]{};
+    uint64_t available_orders{};
 };
 
 // Instance created in primary_phys.cpp
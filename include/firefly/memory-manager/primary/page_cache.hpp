@@ -0,0 +1,193 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "firefly/compiler/clang++.hpp"
+#include "firefly/memory-manager/mm.hpp"
+#include "firefly/memory-manager/primary/buddy.hpp"
+
+namespace firefly::kernel::mm {
+
+// Per-CPU cache of low order blocks sitting in front of the BuddyManager.
+// Allocating or freeing a cached block is a list operation on CPU-local data,
+// the buddy allocators are only touched when a list runs empty (refill) or grows too large (drain).
+// Blocks held by a cache are 'allocated' as far as the buddy allocators are concerned. Their head page drops its
+// reference while the block is cached though, so that freeing a block twice is caught like it is by the buddy allocators.
+class PageCache {
+public:
+    static constexpr int max_order = 3;  // Page orders 0-3 are cached (4KiB - 32KiB)
+    static constexpr int batch = 16;     // Number of blocks moved between the buddy and a list at once
+    static constexpr int high = 64;      // A list is drained by one batch once it reaches this many blocks
+
+    // Page order (log2 of the number of pages) needed to hold 'size' bytes.
+    static inline int order_of(uint64_t size) {
+        uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        int order = 0;
+        while ((1ull << order) < pages)
+            ++order;
+
+        return order;
+    }
+
+    void init(BuddyManager *backend) {
+        this->backend = backend;
+        for (auto &list : lists)
+            list = {};
+    }
+
+    PhysicalAddress alloc(int order) {
+        auto &list = lists[order];
+        if (unlikely(list.head == nullptr) && !refill(order))
+            return nullptr;
+
+        return hand_out(pop_head(list));
+    }
+
+    // Hand out up to 'count' cached blocks without refilling, returns the number of blocks taken.
+    uint64_t take(int order, PhysicalAddress *out, uint64_t count) {
+        auto &list = lists[order];
+        uint64_t n = 0;
+
+        for (; n < count && list.head != nullptr; n++)
+            out[n] = hand_out(pop_head(list));
+
+        return n;
+    }
+
+    // Recently freed blocks are likely to be cache-hot and are handed out first.
+    // 'cold' blocks (i.e. freed after DMA) are queued at the tail and are the first to be drained.
+    void free(PhysicalAddress ptr, int order, bool cold = false) {
+        auto &list = lists[order];
+        auto block = static_cast<CachedBlock *>(ptr);
+
+        auto page = pagelist.virt_to_page(ptr);
+        if (unlikely(page->refcount.load(std::memory_order_relaxed) == 0)) {
+            info_logger << "Caught potential double-free: " << info_logger.hex(ptr) << logger::endl;
+            return;
+        }
+        page->refcount.store(0, std::memory_order_relaxed);
+
+        if (cold)
+            push_tail(list, block);
+        else
+            push_head(list, block);
+
+        if (unlikely(list.count >= high))
+            drain(order, batch);
+    }
+
+    // Return up to 'count' of the coldest blocks of an order to the buddy allocators.
+    int drain(int order, int count) {
+        auto &list = lists[order];
+        PhysicalAddress blocks[batch];
+        int drained = 0;
+
+        while (drained < count && list.tail != nullptr) {
+            int n = 0;
+            for (; n < batch && drained + n < count && list.tail != nullptr; n++)
+                blocks[n] = hand_out(pop_tail(list));
+
+            backend->free_bulk(blocks, n);
+            drained += n;
+        }
+
+        return drained;
+    }
+
+    // Number of pages held by this cache
+    uint64_t cached_pages() const {
+        uint64_t pages = 0;
+        for (int order = 0; order <= max_order; order++)
+            pages += uint64_t(lists[order].count) << order;
+
+        return pages;
+    }
+
+private:
+    struct CachedBlock {
+        CachedBlock *next;
+        CachedBlock *prev;
+    };
+
+    struct List {
+        CachedBlock *head;
+        CachedBlock *tail;
+        int count;
+    };
+
+    bool refill(int order) {
+        auto &list = lists[order];
+        PhysicalAddress blocks[batch];
+
+        const auto n = backend->alloc_bulk(PAGE_SIZE << order, blocks, batch);
+        for (uint64_t i = 0; i < n; i++) {
+            pagelist.virt_to_page(blocks[i])->refcount.store(0, std::memory_order_relaxed);
+            push_tail(list, static_cast<CachedBlock *>(blocks[i]));
+        }
+
+        return list.head != nullptr;
+    }
+
+    // The block leaves the cache, its head page takes its reference again.
+    static inline PhysicalAddress hand_out(CachedBlock *block) {
+        pagelist.virt_to_page(block)->refcount.store(1, std::memory_order_relaxed);
+        return block;
+    }
+
+    static inline void push_head(List &list, CachedBlock *block) {
+        block->prev = nullptr;
+        block->next = list.head;
+
+        if (list.head)
+            list.head->prev = block;
+        else
+            list.tail = block;
+
+        list.head = block;
+        list.count++;
+    }
+
+    static inline void push_tail(List &list, CachedBlock *block) {
+        block->next = nullptr;
+        block->prev = list.tail;
+
+        if (list.tail)
+            list.tail->next = block;
+        else
+            list.head = block;
+
+        list.tail = block;
+        list.count++;
+    }
+
+    static inline CachedBlock *pop_head(List &list) {
+        auto block = list.head;
+        list.head = block->next;
+
+        if (list.head)
+            list.head->prev = nullptr;
+        else
+            list.tail = nullptr;
+
+        list.count--;
+        return block;
+    }
+
+    static inline CachedBlock *pop_tail(List &list) {
+        auto block = list.tail;
+        list.tail = block->prev;
+
+        if (list.tail)
+            list.tail->next = nullptr;
+        else
+            list.head = nullptr;
+
+        list.count--;
+        return block;
+    }
+
+private:
+    List lists[max_order + 1];
+    BuddyManager *backend;
+};
+}  // namespace firefly::kernel::mm
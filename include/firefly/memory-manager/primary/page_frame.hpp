@@ -1,79 +1,148 @@
 #pragma once
 
+#include <cstdlib/cassert.h>
 #include <cstdlib/cstring.h>
 
+#include <algorithm>
+
 #include "firefly/logger.hpp"
+#include "firefly/memory-manager/hhdm.hpp"
 #include "firefly/memory-manager/mm.hpp"
-#include "firefly/memory-manager/primary/primary_phys.hpp"
-#include "libk++/bits.h"
 
 namespace firefly::kernel::mm {
+
+// Early boot page allocator, it serves page tables until the physical memory manager is up.
+// Unlike the physical memory manager it hands out physical addresses, the pages are accessed through phys_to_virt().
+// Every page of its region is tracked by one bit (set = free), so initialization clears one word per 64 pages
+// and physically contiguous runs of pages (i.e. a whole page table subtree) can be found by scanning words.
+// Once the physical memory manager takes over, the pages that are still free are handed to it with release().
 class PageFrame {
 public:
     static constexpr bool verbose = !false;
+    static constexpr uint64_t max_pages = 1024;  // 4MiB
 
-    template <typename T>
-    class Freelist {
-    private:
-        T list;
-
-    public:
-        void add(const T &block) {
-            *(T *)block = list;
-            list = block;
+    void init(PhysicalAddress base, size_t length) {
+        assert_truth(length / PAGE_SIZE <= max_pages && "Region is too large for the early page allocator");
 
-            // if constexpr (verbose)
-            //     info_logger << "freelist::add(): Added '" << info_logger.hex(block) << "' to the freelist\n";
-        }
+        this->base = reinterpret_cast<uint64_t>(base);
+        num_pages = length / PAGE_SIZE;
 
-        T remove(FillMode fill) {
-            T element = list;
-            list = *(T *)list;
+        const auto full_words = num_pages / 64;
+        for (uint64_t i = 0; i < words; i++)
+            bitmap[i] = i < full_words ? ~0ull : 0;
 
-            if (fill != FillMode::NONE)
-                memset(element, fill, PAGE_SIZE);
+        if (num_pages % 64)
+            bitmap[full_words] = (1ull << (num_pages % 64)) - 1;
 
-            return element;
-        }
-    };
-    Freelist<PhysicalAddress> freelist;
+        if constexpr (verbose)
+            info_logger << info_logger.format("base: 0x%x | top: 0x%x | pages: %d\n", this->base, this->base + num_pages * PAGE_SIZE, num_pages);
 
-    void init(PhysicalAddress base, size_t length) {
-        freelist.add(nullptr);
-        addRange(reinterpret_cast<uint64_t>(base), length);
         info_logger << "page-allocator: Initialized " << logger::endl;
     }
 
     PhysicalAddress allocate(FillMode fill = FillMode::ZERO) {
-        auto ptr = freelist.remove(fill);
-        if (!ptr) {
-            auto fallback = Physical::allocate(4 * PAGE_SIZE);
-            if (!fallback)
-                return nullptr;
-
-            addRange(reinterpret_cast<uint64_t>(fallback), 4 * PAGE_SIZE);
-            return freelist.remove(FillMode::NONE);  // Physical::Allocate already cleared the memory
-        }
-        return ptr;
+        return allocate_run(1, fill);
     }
 
-    void deallocate(PhysicalAddress ptr) {
-        if (ptr)
-            freelist.add(ptr);
-    };
+    // Allocate 'pages' physically contiguous pages, the lowest free run that is large enough is used.
+    PhysicalAddress allocate_run(uint64_t pages, FillMode fill = FillMode::ZERO) {
+        for (auto first = next_free(0); first < num_pages;) {
+            const auto end = next_used(first);
 
-    void addRange(uint64_t base, uint64_t len) {
-        auto pages = ((base + len - 1) - base) / PAGE_SIZE;
-        auto top = base + pages * PAGE_SIZE;
+            if (end - first >= pages) {
+                set_range(first, pages, false);
 
-        if constexpr (verbose)
-            info_logger << info_logger.format("base: 0x%x | top: 0x%x | pages: %d\n", base, top, pages);
+                auto ptr = reinterpret_cast<PhysicalAddress>(base + first * PAGE_SIZE);
+                if (fill != FillMode::NONE)
+                    memset(phys_to_virt(base + first * PAGE_SIZE), fill, pages * PAGE_SIZE);
 
-        for (auto i = 0ul; i < (len / PAGE_SIZE); i++) {
-            for (auto i = 0ul; i <= pages; i++) {
-                freelist.add(reinterpret_cast<PhysicalAddress>(base + (i * PAGE_SIZE)));
+                return ptr;
             }
+
+            first = next_free(end);
         }
+
+        return nullptr;
+    }
+
+    void deallocate(PhysicalAddress ptr, uint64_t pages = 1) {
+        if (!ptr)
+            return;
+
+        const auto first = (reinterpret_cast<uint64_t>(ptr) - base) / PAGE_SIZE;
+        assert_truth(reinterpret_cast<uint64_t>(ptr) >= base && first + pages <= num_pages && "Page does not belong to the early page allocator");
+        assert_truth(next_free(first) >= first + pages && "Double free in the early page allocator");
+
+        set_range(first, pages, true);
+    }
+
+    uint64_t free_pages() const {
+        uint64_t pages = 0;
+        for (auto word : bitmap)
+            pages += __builtin_popcountll(word);
+
+        return pages;
+    }
+
+    PhysicalRange range() const {
+        return { .base = base, .length = num_pages * PAGE_SIZE };
     }
+
+    // Invoke 'func(base, length)' on every run of free pages and take them out of this allocator.
+    // Pages which are in use (and pages freed afterwards) are never passed on.
+    template <typename Func>
+    void release(Func &&func) {
+        for (auto first = next_free(0); first < num_pages; first = next_free(first)) {
+            const auto end = next_used(first);
+            set_range(first, end - first, false);
+
+            func(base + first * PAGE_SIZE, (end - first) * PAGE_SIZE);
+            first = end;
+        }
+    }
+
+private:
+    static constexpr uint64_t words = max_pages / 64;
+
+    // Index of the first free page at or after 'page', num_pages if there is none.
+    uint64_t next_free(uint64_t page) const {
+        return next_bit(page, 0);
+    }
+
+    // Index of the first allocated page at or after 'page', num_pages if there is none.
+    uint64_t next_used(uint64_t page) const {
+        return next_bit(page, ~0ull);
+    }
+
+    // Pages beyond num_pages are never free, so the search stops at num_pages in either case.
+    uint64_t next_bit(uint64_t page, uint64_t invert) const {
+        while (page < num_pages) {
+            const auto word = (bitmap[page / 64] ^ invert) & (~0ull << (page % 64));
+            if (word)
+                return std::min<uint64_t>(num_pages, (page & ~63ull) + __builtin_ctzll(word));
+
+            page = (page & ~63ull) + 64;
+        }
+
+        return num_pages;
+    }
+
+    void set_range(uint64_t first, uint64_t count, bool free) {
+        for (uint64_t page = first, end = first + count; page < end;) {
+            const auto bits = std::min<uint64_t>(64 - page % 64, end - page);
+            const auto mask = (bits == 64 ? ~0ull : (1ull << bits) - 1) << (page % 64);
+
+            if (free)
+                bitmap[page / 64] |= mask;
+            else
+                bitmap[page / 64] &= ~mask;
+
+            page += bits;
+        }
+    }
+
+private:
+    uint64_t bitmap[words]{};
+    uint64_t base{}, num_pages{};
 };
 }  // namespace firefly::kernel::mm
@@ -6,8 +6,108 @@
 #include "firefly/stivale2.hpp"
 
 namespace firefly::kernel::mm::Physical {
-void init(stivale2_struct_tag_memmap *mmap);
+// Log2 histogram of cycle counts, bucket 'n' counts samples that took [2^(n-1), 2^n) cycles.
+struct LatencyHistogram {
+    static constexpr int buckets = 40;
+
+    uint64_t counts[buckets];
+    uint64_t samples;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+
+    inline void record(uint64_t cycles) {
+        const int bucket = cycles ? 64 - __builtin_clzll(cycles) : 0;
+        counts[bucket < buckets ? bucket : buckets - 1]++;
+        samples++;
+        total_cycles += cycles;
+        if (cycles > max_cycles)
+            max_cycles = cycles;
+    }
+
+    // Upper bound (in cycles) of the bucket containing the p-th percentile, p in [0, 100]
+    inline uint64_t percentile(uint64_t p) const {
+        uint64_t seen = 0;
+        for (int i = 0; i < buckets; i++) {
+            seen += counts[i];
+            if (seen * 100 >= samples * p && seen)
+                return 1ull << i;
+        }
+
+        return 0;
+    }
+};
+
+struct Stats {
+    uint64_t total_pages;         // Pages managed by the buddy allocators
+    uint64_t free_pages;          // Pages on the buddy freelists
+    uint64_t cached_pages;        // Free pages held by the per-CPU page caches and the zero pool
+    uint64_t used_pages;          // Pages handed out, total - free - cached
+    uint64_t failures;            // Calls to allocate() which returned nullptr
+    uint64_t splits;              // Blocks split in two to satisfy an allocation
+    uint64_t merges;              // Buddies merged on free
+    int largest_free_order;       // Page order of the largest free block, -1 if there is none
+    uint64_t fragmentation;       // Per mille: 1000 * (1 - largest free block / free memory), 0 is no fragmentation at all
+};
+
+static constexpr int stat_orders = 29;  // Page orders 0 (4KiB) to 28 (1TiB), see BuddyAllocator::largest_allowed_order
+
+struct ZoneStats {
+    uint64_t base;  // Physical
+    uint64_t length;
+    uint64_t free_pages;
+    uint64_t free_blocks[stat_orders];  // Free blocks by page order
+};
+
+struct ZeroPoolStats {
+    uint64_t pages;   // Zeroed pages currently pooled
+    uint64_t hits;    // Zero-fill allocations served from the pool
+    uint64_t misses;  // Zero-fill allocations that had to clear the page synchronously
+};
+
+// 'early' is memory taken out of the memory map by the early boot allocator, see core::paging::early_allocator_range().
+// It is managed as well but nothing in it is free until it is passed to free_range().
+// Memory is handed out (and taken back) by its address in the direct map, see phys_to_virt().
+void init(stivale2_struct_tag_memmap *mmap, PhysicalRange early = {});
 PhysicalAddress allocate(uint64_t size = 4096, FillMode fill = FillMode::ZERO);
 PhysicalAddress must_allocate(uint64_t size = 4096, FillMode fill = FillMode::ZERO);
 void deallocate(PhysicalAddress ptr);
+
+// Make the page aligned physical range [base, base + length) available for allocation.
+// It must lie within memory passed to init(), i.e. the leftovers of the early boot allocator.
+void free_range(uint64_t base, uint64_t length);
+
+// End of the highest entry of the memory map, usable or not.
+uint64_t highest_address();
+
+// Batched versions of allocate() and deallocate() for callers needing many blocks of the same size at once.
+// allocate_bulk() fills 'out' with up to 'count' blocks and returns how many it allocated, the buddy allocators
+// are searched once per zone instead of once per block. deallocate_bulk() skips nullptr entries.
+uint64_t allocate_bulk(PhysicalAddress *out, uint64_t count, uint64_t size = 4096, FillMode fill = FillMode::ZERO);
+void deallocate_bulk(const PhysicalAddress *ptrs, uint64_t count);
+
+// The buddy allocators without the per-CPU caches in front of them, for benchmarks of the buddy allocators themselves.
+// Nothing is measured, filled or reclaimed. Blocks from allocate_uncached() must be freed with deallocate_uncached().
+PhysicalAddress allocate_uncached(uint64_t size);
+void deallocate_uncached(PhysicalAddress ptr);
+
+// Clear up to 'budget' pages ahead of time for later FillMode::ZERO allocations.
+// Call this from idle or otherwise deferred contexts, returns the number of pages zeroed.
+uint64_t refill_zero_pool(uint64_t budget = 64);
+ZeroPoolStats zero_pool_stats();
+
+// Allocator statistics, cheap enough to be queried at any time.
+Stats stats();
+uint64_t zone_count();
+ZoneStats zone_stats(uint64_t zone);
+
+// Page order 'order' fragmentation index in per mille: The share of free memory that sits in
+// blocks too small to satisfy an allocation of that order. 0 means every free page is usable for it.
+uint64_t fragmentation_index(int order);
+
+// Cycles spent in allocate() and deallocate(), only recorded if measure_latency is enabled in primary_phys.cpp.
+const LatencyHistogram &allocate_latency();
+const LatencyHistogram &deallocate_latency();
+
+// Print all of the above, also called when the kernel panics.
+void dump_stats();
 }  // namespace firefly::kernel::mm::Physical
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "cstdlib/cstring.h"
+#include "firefly/memory-manager/mm.hpp"
+
+namespace firefly::kernel::mm {
+
+// Pool of pages that have been cleared ahead of time.
+// FillMode::ZERO allocations of a single page are served from here so that the clearing cost
+// is paid by refill(), which runs from a deferred context, instead of by the caller.
+// The first word of a pooled page links it to the next one and is cleared when the page is handed out.
+class ZeroPool {
+public:
+    static constexpr uint64_t target = 256;  // Number of zeroed pages refill() aims to keep around
+
+    PhysicalAddress take() {
+        auto page = head;
+        if (page == nullptr) {
+            misses++;
+            return nullptr;
+        }
+
+        head = page->next;
+        page->next = nullptr;
+        count--;
+        hits++;
+        return page;
+    }
+
+    // Zero and pool up to 'budget' pages obtained from 'source'.
+    // Returns the number of pages that were added.
+    template <typename Source>
+    uint64_t refill(Source source, uint64_t budget) {
+        uint64_t added = 0;
+
+        for (; added < budget && count < target; added++) {
+            auto page = static_cast<ZeroedPage *>(source());
+            if (page == nullptr)
+                break;
+
+            memset(static_cast<void *>(page), 0, PAGE_SIZE);
+            page->next = head;
+            head = page;
+            count++;
+        }
+
+        return added;
+    }
+
+    // Hand up to 'pages' pooled pages to 'release', returns the number of pages released.
+    template <typename Release>
+    uint64_t drain(uint64_t pages, Release release) {
+        uint64_t released = 0;
+
+        for (; released < pages && head != nullptr; released++) {
+            auto page = head;
+            head = page->next;
+            count--;
+            release(static_cast<PhysicalAddress>(page));
+        }
+
+        return released;
+    }
+
+    uint64_t pages() const {
+        return count;
+    }
+
+    uint64_t hit_count() const {
+        return hits;
+    }
+
+    uint64_t miss_count() const {
+        return misses;
+    }
+
+private:
+    struct ZeroedPage {
+        ZeroedPage *next;
+    };
+
+    ZeroedPage *head{ nullptr };
+    uint64_t count{}, hits{}, misses{};
+};
+}  // namespace firefly::kernel::mm
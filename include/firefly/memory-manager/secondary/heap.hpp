@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace firefly::kernel::mm {
+
+// General purpose kernel heap.
+// Requests up to slab::max_size are served by the size class caches, larger ones by the physical allocator
+// (rounded up to a power-of-two number of pages). kfree() tells both apart by the page descriptor of the pointer,
+// so no size has to be passed and no header is stored in front of the allocation.
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+// Memory aligned to 'align', which must be a power of two no larger than PAGE_SIZE. Freed with kfree().
+void *kmalloc_aligned(size_t size, size_t align);
+
+// Usable size of an allocation, at least the size that was requested.
+size_t kmalloc_usable_size(const void *ptr);
+
+// Allocator for frigg containers, i.e. frg::vector<T, KernelAllocator>.
+struct KernelAllocator {
+    void *allocate(size_t size) {
+        return kmalloc(size);
+    }
+
+    void deallocate(void *ptr, [[maybe_unused]] size_t size) {
+        kfree(ptr);
+    }
+
+    void free(void *ptr) {
+        kfree(ptr);
+    }
+};
+}  // namespace firefly::kernel::mm
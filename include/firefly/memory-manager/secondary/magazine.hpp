@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "firefly/intel64/cpu.hpp"
+#include "libk++/spinlock.h"
+
+namespace firefly::kernel::mm {
+
+// A stack of free objects ("rounds") which is handed between a CPU and the depot as a whole.
+struct Magazine {
+    Magazine *next;
+    uint32_t rounds;
+    uint32_t capacity;
+    void *round[];
+};
+
+struct MagazineStats {
+    uint64_t capacity;     // Capacity of newly created magazines
+    uint64_t cached;       // Objects held by magazines
+    uint64_t depot_full;   // Full magazines in the depot
+    uint64_t depot_empty;  // Empty magazines in the depot
+    uint64_t contended;    // Depot accesses which had to wait for the lock
+};
+
+// Bonwick style magazine layer which sits in front of an object cache.
+// Every CPU owns two magazines: 'loaded' which allocations and frees work on and 'previous', which is either full
+// or empty. When neither can serve a request, the CPU trades a magazine with the depot, a locked list of full
+// and empty magazines shared by all CPUs. Only if the depot can't help either does the caller fall back to the
+// object cache itself.
+// The CPU-local paths take no locks and don't touch shared cache lines. They must not be used from interrupt handlers.
+//
+// Magazine capacity adapts to contention: New magazines are made larger while CPUs keep running into each other on
+// the depot lock, which makes depot trips rarer.
+class MagazineLayer {
+public:
+    void init();
+
+    // Take a cached object, nullptr if there is none.
+    void *pop();
+
+    // Cache a freed object, false if there is no room for it (the caller frees it to the object cache).
+    bool push(void *object);
+
+    // Hand every object cached by the depot and this CPU's magazines to 'free_object' and release the magazines.
+    // Magazines loaded on other CPUs are left alone.
+    template <typename Func>
+    void purge(Func &&free_object) {
+        auto cpu = &cpus[core::cpu::id()];
+        Magazine *magazines[2] = { cpu->loaded, cpu->previous };
+        cpu->loaded = cpu->previous = nullptr;
+
+        depot_lock.lock();
+        auto full = depot_full, empty = depot_empty;
+        depot_full = depot_empty = nullptr;
+        full_count = empty_count = depot_rounds = 0;
+        depot_lock.unlock();
+
+        auto drain = [&](Magazine *magazine) {
+            while (magazine) {
+                auto next = magazine->next;
+                for (uint32_t i = 0; i < magazine->rounds; i++)
+                    free_object(magazine->round[i]);
+
+                free_magazine(magazine);
+                magazine = next;
+            }
+        };
+
+        for (auto magazine : magazines) {
+            if (magazine)
+                magazine->next = nullptr;
+            drain(magazine);
+        }
+
+        drain(full);
+        drain(empty);
+    }
+
+    MagazineStats stats() const;
+
+    // Set up the caches magazines are allocated from, before any MagazineLayer is used.
+    static void init_magazine_caches();
+
+    // Capacities are chosen so that a magazine fills a power-of-two sized object.
+    static constexpr uint32_t capacities[] = { 14, 30, 62, 126 };
+
+private:
+    struct alignas(64) CpuMagazines {
+        Magazine *loaded;
+        Magazine *previous;
+    };
+
+    // Every 'contention_window' depot accesses, magazines grow if more than 1/16th of them were contended.
+    static constexpr uint64_t contention_window = 256;
+
+    void lock_depot();
+    static Magazine *new_magazine(int index);
+    static void free_magazine(Magazine *magazine);
+
+private:
+    CpuMagazines cpus[core::cpu::max_cpus];
+
+    libkern::Spinlock depot_lock;
+    Magazine *depot_full, *depot_empty;
+    uint64_t full_count, empty_count, depot_rounds;
+
+    int size_index;
+    uint64_t depot_accesses, contended_accesses, total_contended;
+};
+}  // namespace firefly::kernel::mm
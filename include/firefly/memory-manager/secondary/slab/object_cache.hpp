@@ -0,0 +1,302 @@
+#pragma once
+
+#include <cstdlib/cassert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+
+#include "firefly/compiler/clang++.hpp"
+#include "firefly/memory-manager/page.hpp"
+#include "firefly/memory-manager/primary/primary_phys.hpp"
+#include "firefly/memory-manager/secondary/heap.hpp"
+#include "firefly/memory-manager/secondary/slab/slab.hpp"
+#include "libk++/spinlock.h"
+
+namespace firefly::kernel::mm {
+
+// Slab cache for objects of type T, with the slab geometry worked out at compile time.
+//
+// With 'cache_constructed' set, objects are constructed once when their slab is created and destroyed only when
+// the slab goes back to the physical allocator. deallocate() then expects the object to be in its constructed state
+// again, i.e. a page table with every entry cleared, and allocate() hands it out without touching it.
+// Otherwise T's constructor and destructor run on every allocate() and deallocate().
+//
+// Free objects are tracked by index in the slab header, never through the objects themselves, so their contents
+// survive. Headers of slabs for large objects are kept off-slab (allocated with kmalloc(), which requires
+// slab::init() to have run), so that objects can be packed without a gap and stay naturally aligned.
+//
+// Object caches aren't registered with the shrinkers: deallocate() returns empty slabs beyond SlabCache::keep_empty right away,
+// at most one slab per cache could be reclaimed. Their lock is held across Physical::allocate() in grow(), which
+// a shrinker must not take (see Shrinker::scan()).
+template <typename T, bool cache_constructed = true>
+class ObjectCache {
+    struct Header : Slab {
+        const ObjectCache *owner; // Slab::cache is only set for SlabCache slabs
+        void *memory;        // Start of the slab
+        uint8_t *objects;    // First object, after the header and the colour offset
+        uint64_t free_count;
+        uint16_t free[];     // Indices of the free objects, the last one is handed out next
+    };
+
+public:
+    static constexpr uint64_t align = alignof(T) < alignof(void *) ? alignof(void *) : alignof(T);
+    static constexpr uint64_t object_size = (sizeof(T) + align - 1) & ~(align - 1);
+    static constexpr bool off_slab = object_size >= PAGE_SIZE / 8;
+
+private:
+    struct Geometry {
+        uint64_t order;
+        uint64_t objects;
+        uint64_t header;   // Bytes taken by an on-slab header (including padding up to the first object)
+        uint64_t colours;  // Number of distinct offsets of the first object
+    };
+
+    static constexpr uint64_t min_objects = 8;  // Larger slabs are preferred until they hold at least this many objects
+    static constexpr uint64_t colour_step = align < 64 ? 64 : align;
+
+    static constexpr uint64_t header_bytes(uint64_t objects) {
+        return sizeof(Header) + objects * sizeof(uint16_t);
+    }
+
+    // Use the smallest slab which holds 'min_objects' and wastes at most 1/8th of its memory, like SlabCache does.
+    static constexpr Geometry compute_geometry() {
+        Geometry geometry{};
+
+        for (uint64_t order = 0; order <= SlabCache::max_order; order++) {
+            const uint64_t bytes = PAGE_SIZE << order;
+            uint64_t objects = bytes / object_size, header = 0;
+
+            if (!off_slab) {
+                auto on_slab_header = [](uint64_t objects) { return (header_bytes(objects) + align - 1) & ~(align - 1); };
+                while (objects > 0 && on_slab_header(objects) + objects * object_size > bytes)
+                    objects--;
+                header = on_slab_header(objects);
+            }
+
+            const uint64_t waste = bytes - header - objects * object_size;
+            geometry = { .order = order, .objects = objects, .header = header, .colours = waste / colour_step + 1 };
+
+            if (objects >= min_objects && waste * 8 <= bytes)
+                break;
+        }
+
+        return geometry;
+    }
+
+    static constexpr Geometry geometry = compute_geometry();
+
+public:
+    static constexpr uint64_t order = geometry.order;
+    static constexpr uint64_t objects_per_slab = geometry.objects;
+    static constexpr uint64_t colours = geometry.colours;
+
+    static_assert(objects_per_slab > 0, "Object is too large for a slab");
+    static_assert(objects_per_slab <= UINT16_MAX);
+    static_assert(align <= (PAGE_SIZE << order), "Objects can't be aligned within a slab");
+
+    constexpr explicit ObjectCache(const char *name)
+        : name(name) {
+    }
+
+    ObjectCache(const ObjectCache &) = delete;
+    ObjectCache &operator=(const ObjectCache &) = delete;
+
+    // nullptr if the physical allocator is out of memory.
+    T *allocate() {
+        libkern::LockGuard guard(lock);
+
+        auto slab = static_cast<Header *>(partial.head);
+        if (unlikely(slab == nullptr)) {
+            if (empty.head) {
+                slab = static_cast<Header *>(empty.head);
+                remove(empty, slab);
+            } else {
+                slab = grow();
+                if (slab == nullptr)
+                    return nullptr;
+            }
+
+            push(partial, slab);
+        }
+
+        const auto index = slab->free[--slab->free_count];
+        slab->in_use++;
+        in_use++;
+
+        if (slab->free_count == 0) {
+            remove(partial, slab);
+            push(full, slab);
+        }
+
+        auto object = slab->objects + index * object_size;
+        if constexpr (!cache_constructed)
+            return new (object) T();
+
+        return reinterpret_cast<T *>(object);
+    }
+
+    void deallocate(T *object) {
+        // The page descriptor is checked without the lock. That's only valid for a live object: Its slab can't be
+        // released (which rewrites the descriptors) before the object is freed.
+        auto page = pagelist.virt_to_page(object);
+        assert_truth(page->flags == RawPageFlags::ObjectSlab && "Object does not belong to an object cache");
+
+        auto slab = static_cast<Header *>(page->slab);
+        const auto offset = reinterpret_cast<uint8_t *>(object) - slab->objects;
+        assert_truth(slab->owner == this && "Object belongs to another object cache");
+        assert_truth(offset % object_size == 0 && "Pointer is not the start of an object");
+
+        if constexpr (!cache_constructed)
+            object->~T();
+
+        libkern::LockGuard guard(lock);
+        slab->free[slab->free_count++] = offset / object_size;
+        in_use--;
+
+        if (slab->in_use-- == objects_per_slab) {
+            remove(full, slab);
+            push(partial, slab);
+        }
+
+        if (slab->in_use == 0) {
+            remove(partial, slab);
+            push(empty, slab);
+
+            if (empty.count > SlabCache::keep_empty) {
+                remove(empty, slab);
+                release(slab);
+            }
+        }
+    }
+
+    // Return all empty slabs to the physical allocator, returns the number of pages released.
+    uint64_t shrink() {
+        libkern::LockGuard guard(lock);
+        uint64_t pages = 0;
+
+        while (empty.head) {
+            auto slab = static_cast<Header *>(empty.head);
+            remove(empty, slab);
+            release(slab);
+            pages += 1ull << order;
+        }
+
+        return pages;
+    }
+
+    SlabCacheStats stats() const {
+        const auto slabs = partial.count + full.count + empty.count;
+
+        return { .name = name,
+                 .object_size = object_size,
+                 .objects_per_slab = objects_per_slab,
+                 .slab_pages = 1ull << order,
+                 .partial = partial.count,
+                 .full = full.count,
+                 .empty = empty.count,
+                 .objects_in_use = in_use,
+                 .objects_total = slabs * objects_per_slab,
+                 .magazines = {} };
+    }
+
+private:
+    struct List {
+        Slab *head;
+        uint64_t count;
+    };
+
+    Header *grow() {
+        auto memory = static_cast<uint8_t *>(Physical::allocate(PAGE_SIZE << order, FillMode::NONE));
+        if (memory == nullptr)
+            return nullptr;
+
+        auto slab = reinterpret_cast<Header *>(memory);
+        if constexpr (off_slab) {
+            slab = static_cast<Header *>(kmalloc(header_bytes(objects_per_slab)));
+            if (slab == nullptr) {
+                Physical::deallocate(memory);
+                return nullptr;
+            }
+        }
+
+        // Successive slabs start their objects at different offsets, so that the same object in every slab
+        // doesn't map to the same cache sets.
+        const uint64_t colour = next_colour;
+        next_colour = next_colour + 1 == colours ? 0 : next_colour + 1;
+
+        slab->next = slab->prev = nullptr;
+        slab->cache = nullptr;
+        slab->owner = this;
+        slab->freelist = nullptr;
+        slab->in_use = 0;
+        slab->memory = memory;
+        slab->objects = memory + geometry.header + colour * colour_step;
+        slab->free_count = objects_per_slab;
+
+        // Stacked in reverse so that objects are handed out in address order.
+        for (uint64_t i = 0; i < objects_per_slab; i++) {
+            slab->free[i] = objects_per_slab - 1 - i;
+
+            if constexpr (cache_constructed)
+                new (slab->objects + i * object_size) T();
+        }
+
+        auto page = pagelist.virt_to_page(memory);
+        for (uint64_t i = 0; i < (1ull << order); i++) {
+            page[i].flags = RawPageFlags::ObjectSlab;
+            page[i].slab = slab;
+        }
+
+        return slab;
+    }
+
+    void release(Header *slab) {
+        if constexpr (cache_constructed) {
+            for (uint64_t i = 0; i < objects_per_slab; i++)
+                reinterpret_cast<T *>(slab->objects + i * object_size)->~T();
+        }
+
+        auto page = pagelist.virt_to_page(slab->memory);
+        for (uint64_t i = 0; i < (1ull << order); i++) {
+            page[i].flags = RawPageFlags::None;
+            page[i].slab = nullptr;
+        }
+
+        Physical::deallocate(slab->memory);
+        if constexpr (off_slab)
+            kfree(slab);
+    }
+
+    static void push(List &list, Slab *slab) {
+        slab->prev = nullptr;
+        slab->next = list.head;
+
+        if (list.head)
+            list.head->prev = slab;
+
+        list.head = slab;
+        list.count++;
+    }
+
+    static void remove(List &list, Slab *slab) {
+        if (slab->prev)
+            slab->prev->next = slab->next;
+        else
+            list.head = slab->next;
+
+        if (slab->next)
+            slab->next->prev = slab->prev;
+
+        list.count--;
+    }
+
+private:
+    libkern::Spinlock lock;
+    List partial{}, full{}, empty{};
+
+    const char *name;
+    uint64_t in_use{};
+    uint64_t next_colour{};
+};
+}  // namespace firefly::kernel::mm
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "firefly/memory-manager/mm.hpp"
+#include "firefly/memory-manager/secondary/magazine.hpp"
+#include "libk++/spinlock.h"
+
+namespace firefly::kernel::mm {
+class SlabCache;
+
+// Header at the start of every slab, the objects follow it.
+// Every page of a slab points back to its header (RawPage::slab), which makes finding the owner of an object O(1).
+struct Slab {
+    Slab *next;
+    Slab *prev;
+    SlabCache *cache;
+    void *freelist;  // Free objects, linked through their first word
+    uint64_t in_use;
+};
+
+struct SlabCacheStats {
+    const char *name;
+    uint64_t object_size;
+    uint64_t objects_per_slab;
+    uint64_t slab_pages;      // Pages per slab
+    uint64_t partial, full, empty;  // Number of slabs on each list
+    uint64_t objects_in_use;  // Includes objects cached by magazines
+    uint64_t objects_total;   // Capacity of all slabs
+    MagazineStats magazines;
+};
+
+// Cache of equally sized objects carved out of slabs of 1-8 contiguous pages.
+// Slabs sit on one of three lists: partial (some objects free), full (none free) and empty (all free).
+// Allocations are served from partial slabs first so that empty slabs can be returned to the physical allocator.
+//
+// Unless disabled, a per-CPU magazine layer caches freed objects in front of the slabs. Most allocations and frees
+// are then served without taking the cache lock, only magazine misses go to the slab lists.
+class SlabCache {
+public:
+    static constexpr int max_order = 3;          // Largest slab: 8 pages
+    static constexpr uint64_t keep_empty = 1;    // Empty slabs kept around before they go back to the physical allocator
+    static constexpr bool sanity_checks{};       // Validate pointers passed to deallocate()
+
+    void init(const char *name, uint64_t object_size, uint64_t align = 8, bool magazines = true);
+
+    void *allocate();
+    void deallocate(void *ptr);
+
+    // Flush the magazines and return all empty slabs to the physical allocator, returns the number of pages released.
+    uint64_t shrink();
+
+    SlabCacheStats stats() const;
+
+    // Every initialized cache, i.e. for statistics
+    static SlabCache *first() {
+        return caches;
+    }
+
+    SlabCache *next() const {
+        return next_cache;
+    }
+
+private:
+    struct List {
+        Slab *head;
+        uint64_t count;
+    };
+
+    // Called with the lock held, it's dropped while a new slab is allocated.
+    void *allocate_from_slab();
+    void deallocate_to_slab(void *ptr);
+
+    Slab *grow();
+    void release(Slab *slab);
+
+    static void push(List &list, Slab *slab);
+    static void remove(List &list, Slab *slab);
+
+private:
+    MagazineLayer magazine_layer;
+    bool use_magazines;
+
+    libkern::Spinlock lock;  // Protects the slab lists
+    List partial, full, empty;
+
+    const char *name;
+    uint64_t size;
+    uint64_t order;
+    uint64_t objects_per_slab;
+    uint64_t first_object;  // Offset of the first object from the slab header
+    uint64_t in_use;
+
+    SlabCache *next_cache;
+    static SlabCache *caches;
+};
+
+// General purpose caches with power-of-two and in-between size classes.
+namespace slab {
+static constexpr uint64_t max_size = 2048;  // Larger requests are better served by the physical allocator
+
+void init();
+
+// Allocate from the smallest size class that fits 'size', nullptr if size > max_size or memory ran out.
+void *allocate(uint64_t size);
+
+// Free an object of any slab cache.
+void deallocate(void *ptr);
+
+// Cache owning 'ptr', nullptr if 'ptr' isn't slab memory. 'ptr' must be memory handed out by the physical allocator.
+SlabCache *owner(const void *ptr);
+
+// Print the utilization of every cache.
+void dump_stats();
+}  // namespace slab
+}  // namespace firefly::kernel::mm
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace firefly::kernel::mm {
+
+enum class ReclaimReason {
+    LowWatermark,       // Free memory dropped below the low watermark, allocations still succeed
+    AllocationFailure,  // An allocation failed, everything that can be freed is fair game
+};
+
+// A kernel cache which can give memory back to the physical allocator when it runs low.
+// Shrinkers are registered once (registering one again has no effect) and never go away, instances are expected to
+// be constant-initialized globals.
+class Shrinker {
+public:
+    // Shrinkers run in ascending order of priority. Caches which free into other caches (i.e. slab pages go to the
+    // per-CPU page caches) must run before those.
+    // A 'last_resort' shrinker holds memory that is worth more than a free page (i.e. pages zeroed ahead of time),
+    // it only runs once an allocation failed.
+    constexpr Shrinker(const char *name, int priority, bool last_resort = false)
+        : name(name), priority(priority), last_resort(last_resort) {
+    }
+
+    // Number of pages scan() could free right now, an estimate is fine.
+    virtual uint64_t count() const = 0;
+
+    // Free at least 'pages' pages if possible, returns the number of pages freed.
+    //
+    // count() and scan() run inside Physical::allocate() on whichever CPU ran low. They must not take a lock that
+    // can be held across a call to Physical::allocate() (or anything allocating through it), that CPU would spin on
+    // its own lock. SlabCache drops its lock while it grows for this reason.
+    virtual uint64_t scan(uint64_t pages) = 0;
+
+    const char *const name;
+    const int priority;
+    const bool last_resort;
+
+private:
+    friend void register_shrinker(Shrinker &shrinker);
+    friend uint64_t reclaim(uint64_t pages, ReclaimReason reason);
+    friend void dump_reclaim_stats();
+
+    Shrinker *next{ nullptr };
+    uint64_t reclaimed{};
+};
+
+struct ReclaimStats {
+    uint64_t runs;        // Calls to reclaim()
+    uint64_t pages;       // Pages freed by shrinkers
+    uint64_t shortfalls;  // Runs which freed less than they were asked to
+};
+
+void register_shrinker(Shrinker &shrinker);
+
+// Ask the registered shrinkers to free 'pages' pages, returns how many they freed.
+// Called by the physical allocator when free memory drops below its low watermark or an allocation fails.
+uint64_t reclaim(uint64_t pages, ReclaimReason reason = ReclaimReason::AllocationFailure);
+
+ReclaimStats reclaim_stats();
+void dump_reclaim_stats();
+}  // namespace firefly::kernel::mm
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "firefly/memory-manager/primary/primary_phys.hpp"
+
+namespace firefly::kernel::mm {
+
+// Error code the CPU pushes for a page fault (vector 14).
+namespace PageFaultError {
+enum : uint64_t {
+    Present = 1 << 0,  // Protection violation, the page was mapped
+    Write = 1 << 1,
+    User = 1 << 2,
+    ReservedBit = 1 << 3,  // A reserved bit was set in a paging structure
+    InstructionFetch = 1 << 4
+};
+}  // namespace PageFaultError
+
+// Resolve the page fault at 'address' by looking up the region it belongs to.
+// Faults on pages which are reserved but not backed yet (vmalloc_lazy()) map a zeroed page, after which the
+// access can be retried. Returns false if the fault can't be resolved, i.e. for protection violations.
+bool handle_page_fault(uint64_t address, uint64_t error);
+
+struct PageFaultStats {
+    uint64_t minor_faults;  // Resolved by mapping a page
+    uint64_t unresolved;
+};
+
+PageFaultStats page_fault_stats();
+const Physical::LatencyHistogram &page_fault_latency();
+
+void dump_page_fault_stats();
+}  // namespace firefly::kernel::mm
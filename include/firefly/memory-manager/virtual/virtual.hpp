@@ -18,15 +18,23 @@ private:
     friend class frg::manual_box<kernelPageSpace>;
     kernelPageSpace(PhysicalAddress root) {
         initSpace(root);
+        pcid = core::paging::Pcid::kernel();
     }
 
 public:
+    // The direct map only covers RAM, which is taken from the memory map before the allocators carve their metadata out of it.
+    static void record_memory_map(const stivale2_struct_tag_memmap *mmap);
     static void init();
     static kernelPageSpace &accessor();
 
     VIRTUAL_SPACE_FUNC_MAP_RANGE;
     VIRTUAL_SPACE_FUNC_UNMAP;
+    VIRTUAL_SPACE_FUNC_UNMAP_RANGE;
     VIRTUAL_SPACE_FUNC_MAP;
+
+    using VirtualSpace::loadAddressSpace;
+    using VirtualSpace::mapRangeAt;
+    using VirtualSpace::root;
 };
 
 /* Represents user processes page tables. Private, one (or more) per task. Currently unused (no userspace) */
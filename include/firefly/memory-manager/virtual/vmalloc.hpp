@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "firefly/memory-manager/mm.hpp"
+
+namespace firefly::kernel::mm {
+
+// Virtually contiguous kernel memory in the AddressLayout::Vmalloc region, backed by individual pages.
+// Large buffers don't need a physically contiguous buddy block this way. The memory isn't cleared (like kmalloc()).
+// Every area is followed by an unmapped guard page.
+//
+// Free ranges of the region are kept in a balanced tree ordered by address, which also tracks the largest free range
+// of every subtree: Finding the lowest range that fits and looking up an area on vfree() are O(log n).
+// vfree() doesn't flush the TLB. Freed ranges wait on a lazy list until enough of them have piled up (or the region
+// runs out of space), then a single flush makes all of them available again.
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+
+// Reserve 'size' bytes like vmalloc() without backing them: Each page is allocated (zeroed) and mapped by the page
+// fault handler when it's first touched, so large reservations cost nothing up front. Freed with vfree().
+// The fault takes the vmalloc lock and allocates memory, which may run reclaim. Lazily backed memory therefore must
+// not be touched by shrinkers, by the allocators themselves or while holding their locks. A fault on the CPU holding
+// the vmalloc lock panics.
+void *vmalloc_lazy(size_t size);
+
+// Back the page at 'address' if it belongs to a vmalloc_lazy() area, called by the page fault handler.
+// False if the address isn't part of one (or there's no memory left).
+bool vmalloc_fault(uint64_t address);
+
+// Reserve a range of the vmalloc region without backing it, the caller maps it however it likes.
+// 'align' must be a power of two and at least PAGE_SIZE. Returns 0 if there is no room left.
+uint64_t vm_reserve(uint64_t size, uint64_t align = PAGE_SIZE);
+
+// Give a reserved range back. It must be unmapped again, including its TLB entries.
+void vm_release(uint64_t base);
+
+struct VmallocStats {
+    uint64_t areas;          // Areas handed out by vmalloc() and vm_reserve()
+    uint64_t mapped_pages;   // Pages backing vmalloc() and vmalloc_lazy() areas
+    uint64_t free_ranges;    // Free ranges in the tree
+    uint64_t largest_free;   // Bytes
+    uint64_t lazy_pages;     // Pages of freed areas waiting for a TLB flush
+    uint64_t purges;         // Flushes which made lazily freed areas available again
+};
+
+VmallocStats vmalloc_stats();
+
+// Requires the kernel address space and the slab allocator.
+void init_vmalloc();
+}  // namespace firefly::kernel::mm
@@ -12,6 +12,11 @@
         VirtualSpace::unmap(virt);      \
     }
 
+#define VIRTUAL_SPACE_FUNC_UNMAP_RANGE              \
+    void unmapRange(T base, T len) const override { \
+        VirtualSpace::unmapRange(base, len);        \
+    }
+
 #define VIRTUAL_SPACE_FUNC_MAP                                   \
     void map(T virt, T phys, AccessFlags flags) const override { \
         VirtualSpace::map(virt, phys, flags);                    \
@@ -35,9 +40,6 @@ public:
         Physical::deallocate(PhysicalAddress(pml4));
     }
 
-    void operator delete([[maybe_unused]] void *ptr) {
-    }
-
 protected:
     using T = uint64_t;
 
@@ -46,16 +48,26 @@ protected:
     }
 
     virtual void map(T virtual_addr, T physical_addr, AccessFlags flags) const {
-        core::paging::map(virtual_addr, physical_addr, flags, pml4);
+        core::paging::map(virtual_addr, physical_addr, flags, pml4, core::paging::PageSize::Small, &pcid);
     }
 
+    // Uses 2MiB and 1GiB pages wherever the range allows it.
     virtual void mapRange(uint64_t base, uint64_t len, AccessFlags flags, AddressLayout offset = AddressLayout::Low) const {
-        for (uint64_t i = base; i < (base + len); i += PAGE_SIZE)
-            map(i + offset, i, flags);
+        core::paging::map_range(base + offset, base, len, flags, pml4, &pcid);
     }
 
-    virtual void unmap([[maybe_unused]] T virtual_addr) const {
-        firefly::panic("unmap() has not been implemented");
+    // Map [physical_base, physical_base + len) at 'virtual_base', which doesn't need to be a fixed offset away.
+    inline void mapRangeAt(T virtual_base, T physical_base, T len, AccessFlags flags) const {
+        core::paging::map_range(virtual_base, physical_base, len, flags, pml4, &pcid);
+    }
+
+    virtual void unmap(T virtual_addr) const {
+        core::paging::unmap(virtual_addr, pml4, &pcid);
+    }
+
+    // Small ranges are invalidated page by page, larger ones flush the TLB. (See core::paging::set_flush_threshold())
+    virtual void unmapRange(T base, T len) const {
+        core::paging::unmap_range(base, len, pml4, &pcid);
     }
 
     inline void invalidate(VirtualAddress page) const {
@@ -70,10 +82,14 @@ protected:
         return reinterpret_cast<T>(pml4);
     }
 
+    // Keeps the TLB entries of this address space if its PCID is still valid.
     inline void loadAddressSpace() const {
-        asm("mov %0, %%cr3" ::"r"(reinterpret_cast<uintptr_t>(pml4)));
+        core::paging::load_address_space(pml4, pcid);
     }
 
+    // Assigned on the first load, see core::paging::Pcid.
+    mutable core::paging::Pcid pcid;
+
 private:
     T *pml4;
 };
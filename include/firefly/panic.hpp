@@ -4,11 +4,15 @@
 #include "firefly/trace/strace.hpp"
 
 namespace firefly {
+namespace kernel::mm::Physical {
+void dump_stats();
+}
 
 [[gnu::used]]
 [[noreturn]] static void panic(const char *msg) {
     kernel::info_logger << "\n**** Kernel panic ****\nReason: " << msg << "\n";
     trace::trace_callstack();
+    kernel::mm::Physical::dump_stats();
 
     while (1)
         asm volatile("hlt");
@@ -19,6 +23,7 @@ namespace firefly {
 assertion_failure_panic(const char *msg) {
     kernel::info_logger << "\n**** Kernel panic ****\nAssertion failed: `" << msg << "`\n";
     trace::trace_callstack();
+    kernel::mm::Physical::dump_stats();
 
     while (1)
         asm volatile("hlt");
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace firefly::libkern {
+
+// Intrusive AVL tree with unique keys. Nodes carry their own links: 'Node *left, *right' and 'int height'.
+// Traits provide 'static Key key(const Node *)' and 'static void update(Node *)'. update() is called bottom-up
+// on every node whose subtree changed, so nodes can keep data aggregated over their subtree (i.e. the largest free range).
+// Nothing is allocated, operations are recursive and O(log n) deep.
+template <typename Node, typename Traits>
+class AvlTree {
+public:
+    using Key = decltype(Traits::key(static_cast<const Node *>(nullptr)));
+
+    Node *root() const {
+        return top;
+    }
+
+    uint64_t size() const {
+        return count;
+    }
+
+    void insert(Node *node) {
+        node->left = node->right = nullptr;
+        node->height = 1;
+        Traits::update(node);
+
+        top = insert(top, node);
+        count++;
+    }
+
+    // 'node' must be in the tree, its key must not have changed since it was inserted.
+    void remove(Node *node) {
+        top = remove(top, Traits::key(node));
+        count--;
+    }
+
+    Node *find(Key key) const {
+        for (auto node = top; node;) {
+            if (key < Traits::key(node))
+                node = node->left;
+            else if (Traits::key(node) < key)
+                node = node->right;
+            else
+                return node;
+        }
+
+        return nullptr;
+    }
+
+    // Node with the largest key <= 'key', nullptr if there is none.
+    Node *floor(Key key) const {
+        Node *result = nullptr;
+        for (auto node = top; node;) {
+            if (key < Traits::key(node)) {
+                node = node->left;
+            } else {
+                result = node;
+                node = node->right;
+            }
+        }
+
+        return result;
+    }
+
+    // Node with the smallest key >= 'key', nullptr if there is none.
+    Node *ceil(Key key) const {
+        Node *result = nullptr;
+        for (auto node = top; node;) {
+            if (Traits::key(node) < key) {
+                node = node->right;
+            } else {
+                result = node;
+                node = node->left;
+            }
+        }
+
+        return result;
+    }
+
+private:
+    static int height(const Node *node) {
+        return node ? node->height : 0;
+    }
+
+    static Node *fix(Node *node) {
+        const auto left = height(node->left), right = height(node->right);
+        node->height = 1 + (left > right ? left : right);
+        Traits::update(node);
+
+        return node;
+    }
+
+    static Node *rotate_right(Node *node) {
+        auto left = node->left;
+        node->left = left->right;
+        left->right = fix(node);
+
+        return fix(left);
+    }
+
+    static Node *rotate_left(Node *node) {
+        auto right = node->right;
+        node->right = right->left;
+        right->left = fix(node);
+
+        return fix(right);
+    }
+
+    // Restore the balance of 'node' after one of its subtrees changed height by at most one.
+    static Node *balance(Node *node) {
+        const auto factor = height(node->left) - height(node->right);
+
+        if (factor > 1) {
+            if (height(node->left->left) < height(node->left->right))
+                node->left = rotate_left(node->left);
+
+            return rotate_right(node);
+        }
+
+        if (factor < -1) {
+            if (height(node->right->right) < height(node->right->left))
+                node->right = rotate_right(node->right);
+
+            return rotate_left(node);
+        }
+
+        return fix(node);
+    }
+
+    static Node *insert(Node *subtree, Node *node) {
+        if (subtree == nullptr)
+            return node;
+
+        if (Traits::key(node) < Traits::key(subtree))
+            subtree->left = insert(subtree->left, node);
+        else
+            subtree->right = insert(subtree->right, node);
+
+        return balance(subtree);
+    }
+
+    static Node *remove_min(Node *subtree, Node *&min) {
+        if (subtree->left == nullptr) {
+            min = subtree;
+            return subtree->right;
+        }
+
+        subtree->left = remove_min(subtree->left, min);
+        return balance(subtree);
+    }
+
+    static Node *remove(Node *subtree, Key key) {
+        if (key < Traits::key(subtree)) {
+            subtree->left = remove(subtree->left, key);
+        } else if (Traits::key(subtree) < key) {
+            subtree->right = remove(subtree->right, key);
+        } else {
+            if (subtree->right == nullptr)
+                return subtree->left;
+
+            // The successor takes the place of the removed node.
+            Node *min;
+            auto right = remove_min(subtree->right, min);
+            min->left = subtree->left;
+            min->right = right;
+
+            return balance(min);
+        }
+
+        return balance(subtree);
+    }
+
+private:
+    Node *top{};
+    uint64_t count{};
+};
+}  // namespace firefly::libkern
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+
+namespace firefly::libkern {
+
+// Test-and-test-and-set spinlock, waiting CPUs spin on a plain load until the lock looks free.
+class Spinlock {
+public:
+    void lock() {
+        while (!try_lock()) {
+            while (locked.load(std::memory_order_relaxed))
+                asm volatile("pause");
+        }
+    }
+
+    bool try_lock() {
+        return !locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic_bool locked{ false };
+};
+
+// Holds a lock for the lifetime of the guard.
+template <typename Lock>
+class LockGuard {
+public:
+    explicit LockGuard(Lock &lock)
+        : lock(lock) {
+        lock.lock();
+    }
+
+    ~LockGuard() {
+        lock.unlock();
+    }
+
+    LockGuard(const LockGuard &) = delete;
+    LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+    Lock &lock;
+};
+}  // namespace firefly::libkern
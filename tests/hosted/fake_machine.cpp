@@ -0,0 +1,118 @@
+#include "fake_machine.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <new>
+
+#include "firefly/intel64/paging.hpp"
+#include "firefly/memory-manager/primary/primary_phys.hpp"
+
+Pagelist pagelist{ fake::page_array_base };
+BuddyManager buddy;
+
+namespace fake {
+// Enough descriptors to cover every page frame up to the end of the fake RAM.
+static constexpr uint64_t page_array_size = ((ram_base + ram_size) >> PAGE_SHIFT) * sizeof(RawPage);
+
+// Pages left accessible by a previous boot must not hide accesses outside of the new runs.
+static void reset_page_array() {
+    mprotect(reinterpret_cast<void *>(page_array_base), page_array_size, PROT_NONE);
+}
+
+static void map_page_array_run(uint64_t virt, uint64_t length) {
+    if (mprotect(reinterpret_cast<void *>(virt), length, PROT_READ | PROT_WRITE) != 0) {
+        perror("fake: mprotect");
+        abort();
+    }
+}
+}  // namespace fake
+
+// Physical::init() maps the runs of the page array through this, there are no page tables to edit.
+namespace firefly::kernel::core::paging {
+void boot_map_range(uint64_t virtual_addr, uint64_t, uint64_t length) {
+    fake::map_page_array_run(virtual_addr, length);
+}
+}  // namespace firefly::kernel::core::paging
+
+namespace fake {
+
+struct Entry {
+    uint64_t offset;
+    uint64_t length;
+    uint32_t type;
+};
+
+// Offsets relative to ram_base, sorted and non-overlapping like a real stivale2 memory map.
+static constexpr Entry layout[] = {
+    { 0x0, 0x100000, STIVALE2_MMAP_RESERVED },                    // Firmware
+    { 0x100000, 0x2503000, STIVALE2_MMAP_USABLE },                // Odd sized region
+    { 0x2603000, 0x5000, STIVALE2_MMAP_ACPI_RECLAIMABLE },        // Small hole
+    { 0x2608000, 0x59F8000, STIVALE2_MMAP_USABLE },               // Runs up to 128 MiB
+    { 0x8000000, 0x400000, STIVALE2_MMAP_KERNEL_AND_MODULES },    // 4 MiB hole
+    { 0x8400000, 0x7BFF000, STIVALE2_MMAP_USABLE },               // Ends one page short of the fake RAM
+    { 0xFFFF000, 0x1000, STIVALE2_MMAP_BOOTLOADER_RECLAIMABLE },
+};
+
+static constexpr uint64_t num_entries = sizeof(layout) / sizeof(layout[0]);
+
+void map_memory() {
+    auto ram = mmap(reinterpret_cast<void *>(direct_map_base + ram_base), ram_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_FIXED_NOREPLACE, -1, 0);
+    auto array = mmap(reinterpret_cast<void *>(page_array_base), page_array_size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (ram != reinterpret_cast<void *>(direct_map_base + ram_base) || array != reinterpret_cast<void *>(page_array_base)) {
+        perror("fake::map_memory(): mmap");
+        abort();
+    }
+}
+
+stivale2_struct_tag_memmap *memory_map() {
+    alignas(stivale2_struct_tag_memmap) static uint8_t storage[sizeof(stivale2_struct_tag_memmap) + num_entries * sizeof(stivale2_mmap_entry)];
+    auto mmap = reinterpret_cast<stivale2_struct_tag_memmap *>(storage);
+
+    mmap->entries = num_entries;
+    for (uint64_t i = 0; i < num_entries; i++)
+        mmap->memmap[i] = { .base = ram_base + layout[i].offset, .length = layout[i].length, .type = layout[i].type, .unused = 0 };
+
+    return mmap;
+}
+
+void boot(stivale2_struct_tag_memmap *mmap, PhysicalRange early) {
+    reset_page_array();
+
+    pagelist.init(mmap, early);
+    pagelist.for_each_run([](uint64_t virt, uint64_t, uint64_t length) { map_page_array_run(virt, length); });
+    pagelist.populate(mmap);
+
+    new (&buddy) BuddyManager{};
+    buddy.init(mmap, early);
+}
+
+stivale2_struct_tag_memmap *boot() {
+    auto mmap = memory_map();
+    boot(mmap);
+
+    return mmap;
+}
+
+stivale2_struct_tag_memmap *boot_physical() {
+    auto mmap = memory_map();
+    reset_page_array();
+    firefly::kernel::mm::Physical::init(mmap);
+
+    return mmap;
+}
+
+bool is_usable(const stivale2_struct_tag_memmap *mmap, uint64_t base, uint64_t length) {
+    for (uint64_t i = 0; i < mmap->entries; i++) {
+        const auto &e = mmap->memmap[i];
+        if (e.type == STIVALE2_MMAP_USABLE && base >= e.base && base + length <= e.base + e.length)
+            return true;
+    }
+
+    return false;
+}
+}  // namespace fake
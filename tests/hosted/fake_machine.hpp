@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "firefly/memory-manager/hhdm.hpp"
+#include "firefly/memory-manager/page.hpp"
+#include "firefly/memory-manager/primary/buddy.hpp"
+#include "firefly/stivale2.hpp"
+
+// A fake machine for running the physical memory allocators in Linux userspace.
+// "Physical" memory sits above 4GiB and is accessed through a fake direct map: A prefaulted anonymous mapping
+// at direct_map_base + ram_base, so that dereferencing a physical address without phys_to_virt() faults.
+// The page array is reserved PROT_NONE at its own fixed address and only the runs the pagelist
+// asks for are made accessible, so touching a descriptor of a hole faults the same way it would on hardware.
+namespace fake {
+// Both mappings live above the shadow memory of the sanitizers, the page array reservation spans every frame below the end of the RAM.
+static constexpr uint64_t ram_base = 0x100000000;  // Physical, 4GiB
+static constexpr uint64_t ram_size = 256ull << 20;  // 256 MiB
+static constexpr uint64_t direct_map_base = firefly::kernel::mm::direct_map_offset;
+static constexpr uint64_t page_array_base = 0x200000000000;
+
+// Map the fake RAM and the page array reservation. Aborts if the addresses are taken.
+void map_memory();
+
+// A fresh memory map with reserved holes and regions which aren't a power of two in size.
+stivale2_struct_tag_memmap *memory_map();
+
+// Bring up the pagelist and the global buddy manager on 'mmap' (the same steps Physical::init performs).
+// Afterwards 'mmap' reflects what is left after the allocators carved out their metadata.
+void boot(stivale2_struct_tag_memmap *mmap, PhysicalRange early = {});
+stivale2_struct_tag_memmap *boot();
+
+// Bring up the physical memory manager of primary_phys.cpp on a fresh memory map, the global buddy manager is left alone.
+// The slab allocator and kmalloc() take their pages from it.
+stivale2_struct_tag_memmap *boot_physical();
+
+// Whether [base, base + length) lies entirely within one usable entry of 'mmap'.
+bool is_usable(const stivale2_struct_tag_memmap *mmap, uint64_t base, uint64_t length);
+}  // namespace fake
@@ -0,0 +1,4 @@
+#pragma once
+
+// Hosted replacement for the freestanding string functions, use the C library's.
+#include <string.h>
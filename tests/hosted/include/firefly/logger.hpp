@@ -0,0 +1,82 @@
+#pragma once
+
+// Hosted replacement for the kernel logger, prints to stdout.
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <type_traits>
+
+namespace firefly::kernel {
+
+namespace logger {
+static constexpr char endl = '\n';
+
+// Allocator bring-up is chatty, benchmarks turn this off.
+inline bool enabled = true;
+}  // namespace logger
+
+class logger_impl {
+private:
+    char buffer[512];
+
+public:
+    template <typename... VarArgs>
+    logger_impl &operator<<(VarArgs... args) const {
+        ((*this << args), ...);
+        return const_cast<logger_impl &>(*this);
+    }
+
+    logger_impl &operator<<(const char *cstring) const {
+        if (logger::enabled)
+            printf("%s", cstring);
+        return const_cast<logger_impl &>(*this);
+    }
+
+    logger_impl &operator<<(char *cstring) const {
+        return *this << const_cast<const char *>(cstring);
+    }
+
+    logger_impl &operator<<(char chr) const {
+        if (logger::enabled)
+            printf("%c", chr);
+        return const_cast<logger_impl &>(*this);
+    }
+
+    template <typename T>
+    logger_impl &operator<<(T in) const {
+        if (logger::enabled) {
+            if constexpr (std::is_pointer_v<T>)
+                printf("%p", static_cast<const void *>(in));
+            else
+                printf("%lld", static_cast<long long>(in));
+        }
+        return const_cast<logger_impl &>(*this);
+    }
+
+    const char *format(const char *fmt, ...) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buffer, sizeof(buffer) - 1, fmt, ap);
+        va_end(ap);
+
+        return buffer;
+    }
+
+    template <typename T>
+    const char *hex(T in) const {
+        if (logger::enabled)
+            printf("0x%llx", (unsigned long long)(in));
+        return "";
+    }
+
+    constexpr char newline() const {
+        return logger::endl;
+    }
+
+    constexpr char tab() const {
+        return '\t';
+    }
+};
+
+static logger_impl info_logger;
+}  // namespace firefly::kernel
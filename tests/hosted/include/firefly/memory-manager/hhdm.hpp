@@ -0,0 +1,21 @@
+#pragma once
+
+// Hosted replacement for the direct map helpers.
+// The fake RAM is mapped at fake::direct_map_base + its "physical" address, see fake_machine.hpp.
+#include <stdint.h>
+
+#include "firefly/memory-manager/mm.hpp"
+
+namespace firefly::kernel::mm {
+
+static constexpr uint64_t direct_map_offset = 0x300000000000;
+
+template <typename T = void>
+inline T *phys_to_virt(uint64_t phys) {
+    return reinterpret_cast<T *>(phys + direct_map_offset);
+}
+
+inline uint64_t virt_to_phys(const void *virt) {
+    return reinterpret_cast<uint64_t>(virt) - direct_map_offset;
+}
+}  // namespace firefly::kernel::mm
@@ -0,0 +1,19 @@
+#pragma once
+
+// Hosted replacement for the kernel panic handlers, aborts the test.
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace firefly {
+
+[[noreturn]] static inline void panic(const char *msg) {
+    fprintf(stderr, "\n**** Kernel panic ****\nReason: %s\n", msg);
+    abort();
+}
+
+[[noreturn]] static inline void assertion_failure_panic(const char *msg) {
+    fprintf(stderr, "\n**** Kernel panic ****\nAssertion failed: `%s`\n", msg);
+    abort();
+}
+
+}  // namespace firefly
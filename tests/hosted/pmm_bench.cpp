@@ -0,0 +1,198 @@
+// Throughput and latency benchmarks of the physical memory allocators.
+// Usage: pmm_bench [operations]
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "fake_machine.hpp"
+#include "firefly/intel64/cpu.hpp"
+#include "firefly/memory-manager/primary/page_cache.hpp"
+
+using namespace firefly::kernel;
+using core::cpu::rdtsc;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Allocate blocks of one order until the allocator runs dry (or 'limit' is reached), then free them all.
+void allocs_per_order(uint64_t limit) {
+    printf("\n%-8s %10s %14s %14s\n", "size", "blocks", "allocs/sec", "frees/sec");
+
+    std::vector<uint64_t *> blocks;
+    for (int order = 0; order <= 10; order++) {
+        fake::boot();
+        blocks.clear();
+
+        const uint64_t size = uint64_t(PAGE_SIZE) << order;
+        auto start = Clock::now();
+        while (blocks.size() < limit) {
+            auto block = buddy.alloc(size);
+            if (block == nullptr)
+                break;
+            blocks.push_back(block);
+        }
+        const auto alloc_time = seconds_since(start);
+
+        start = Clock::now();
+        for (auto block : blocks)
+            buddy.free(block);
+        const auto free_time = seconds_since(start);
+
+        char label[16];
+        snprintf(label, sizeof(label), "%luK", size >> 10);
+        printf("%-8s %10lu %14.0f %14.0f\n", label, blocks.size(), blocks.size() / alloc_time, blocks.size() / free_time);
+    }
+}
+
+// Pages the buddy manager can hand out right now, everything is freed again before returning.
+uint64_t free_pages() {
+    std::vector<uint64_t *> pages;
+    while (auto page = buddy.alloc(PAGE_SIZE))
+        pages.push_back(page);
+
+    for (auto page : pages)
+        buddy.free(page);
+
+    return pages.size();
+}
+
+// Run a random workload of mixed sizes and report the fragmentation it leaves behind:
+// 1 - (largest free block / free memory), 0 means all free memory is one contiguous block.
+// The p50/p99/max latency of the frees during the workload is reported in cycles.
+void fragmentation_and_free_latency(uint64_t operations) {
+    fake::boot();
+
+    std::mt19937_64 rng(1);
+    std::vector<std::pair<uint64_t *, uint64_t>> live;
+    std::vector<uint64_t> latencies;
+    uint64_t live_bytes = 0;
+
+    const uint64_t total_bytes = free_pages() * PAGE_SIZE;
+    latencies.reserve(operations);
+
+    for (uint64_t i = 0; i < operations; i++) {
+        if (live.empty() || rng() % 100 < 55) {
+            const uint64_t size = PAGE_SIZE << (rng() % 100 < 80 ? rng() % 4 : rng() % 10);
+            auto block = buddy.alloc(size);
+            if (block == nullptr)
+                continue;
+
+            live.emplace_back(block, size);
+            live_bytes += size;
+        } else {
+            std::swap(live[rng() % live.size()], live.back());
+            auto [block, size] = live.back();
+            live.pop_back();
+
+            auto start = rdtsc();
+            buddy.free(block);
+            latencies.push_back(rdtsc() - start);
+            live_bytes -= size;
+        }
+    }
+
+    const uint64_t free_bytes = total_bytes - live_bytes;
+    const uint64_t largest = buddy.largest_free_order() < 0 ? 0 : 1ull << (buddy.largest_free_order() + 3);
+    printf("\nfragmentation after %lu operations: %.3f (largest free block: %lu KiB, free: %lu KiB, %lu live blocks)\n",
+           operations, free_bytes ? 1.0 - double(largest) / free_bytes : 0.0, largest >> 10, free_bytes >> 10, live.size());
+
+    std::sort(latencies.begin(), latencies.end());
+    if (!latencies.empty()) {
+        auto percentile = [&](double p) { return latencies[size_t(p * (latencies.size() - 1))]; };
+        printf("free latency (cycles): p50 %lu, p99 %lu, max %lu\n", percentile(0.5), percentile(0.99), latencies.back());
+    }
+
+    for (auto [block, size] : live)
+        buddy.free(block);
+}
+
+// Single page alloc/free round trips through the per-CPU page cache versus the buddy allocators directly.
+void page_cache_vs_buddy(uint64_t operations) {
+    fake::boot();
+
+    static mm::PageCache cache;
+    cache.init(&buddy);
+
+    constexpr int depth = 32;
+    PhysicalAddress pages[depth];
+
+    auto start = rdtsc();
+    for (uint64_t i = 0; i < operations / depth; i++) {
+        for (auto &page : pages)
+            page = buddy.alloc(PAGE_SIZE);
+        for (auto page : pages)
+            buddy.free(reinterpret_cast<uint64_t *>(page));
+    }
+    const auto direct = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < operations / depth; i++) {
+        for (auto &page : pages)
+            page = cache.alloc(0);
+        for (auto page : pages)
+            cache.free(page, 0);
+    }
+    const auto cached = rdtsc() - start;
+
+    const uint64_t round_trips = (operations / depth) * depth;
+    printf("\norder 0 alloc+free (cycles): buddy %lu, page cache %lu\n", direct / round_trips, cached / round_trips);
+}
+// The same pages allocated and freed one at a time and in batches of 'batch' blocks.
+void bulk_vs_single(uint64_t operations) {
+    fake::boot();
+
+    constexpr uint64_t batch = 64;
+    PhysicalAddress pages[batch];
+    const uint64_t rounds = std::max<uint64_t>(operations / batch, 1);
+
+    uint64_t alloc_cycles = 0, free_cycles = 0;
+    for (uint64_t i = 0; i < rounds; i++) {
+        auto start = rdtsc();
+        for (auto &page : pages)
+            page = buddy.alloc(PAGE_SIZE);
+        alloc_cycles += rdtsc() - start;
+
+        start = rdtsc();
+        for (auto page : pages)
+            buddy.free(static_cast<uint64_t *>(page));
+        free_cycles += rdtsc() - start;
+    }
+
+    uint64_t bulk_alloc_cycles = 0, bulk_free_cycles = 0;
+    for (uint64_t i = 0; i < rounds; i++) {
+        auto start = rdtsc();
+        const auto n = buddy.alloc_bulk(PAGE_SIZE, pages, batch);
+        bulk_alloc_cycles += rdtsc() - start;
+
+        start = rdtsc();
+        buddy.free_bulk(pages, n);
+        bulk_free_cycles += rdtsc() - start;
+    }
+
+    const auto blocks = rounds * batch;
+    printf("\norder 0 per block (cycles): alloc %lu, free %lu one by one | alloc %lu, free %lu in batches of %lu\n",
+           alloc_cycles / blocks, free_cycles / blocks, bulk_alloc_cycles / blocks, bulk_free_cycles / blocks, batch);
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    const uint64_t operations = argc > 1 ? strtoull(argv[1], nullptr, 0) : 1000000;
+
+    logger::enabled = false;
+    fake::map_memory();
+
+    printf("fake RAM: %lu MiB, %lu operations\n", fake::ram_size >> 20, operations);
+    allocs_per_order(operations);
+    fragmentation_and_free_latency(operations);
+    page_cache_vs_buddy(operations);
+    bulk_vs_single(operations);
+    return 0;
+}
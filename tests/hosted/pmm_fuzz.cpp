@@ -0,0 +1,855 @@
+// Randomized alloc/free fuzzing of the physical memory allocators with invariant checks.
+// Usage: pmm_fuzz [seed] [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <random>
+#include <vector>
+
+#include "fake_machine.hpp"
+#include "firefly/memory-manager/primary/page_cache.hpp"
+#include "firefly/memory-manager/primary/page_frame.hpp"
+#include "firefly/memory-manager/secondary/heap.hpp"
+#include "firefly/memory-manager/secondary/slab/object_cache.hpp"
+#include "firefly/memory-manager/secondary/slab/slab.hpp"
+#include "firefly/memory-manager/shrinker.hpp"
+#include "libk++/avl_tree.h"
+
+using namespace firefly::kernel;
+
+#define check(condition, ...)                                                      \
+    do {                                                                           \
+        if (!(condition)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n    ", __FILE__, __LINE__, #condition); \
+            fprintf(stderr, __VA_ARGS__);                                          \
+            fprintf(stderr, "\n");                                                 \
+            abort();                                                               \
+        }                                                                          \
+    } while (0)
+
+namespace {
+// Every live block is tagged at both ends so that an allocator writing into
+// memory it handed out (or handing out memory twice) is caught when the block is freed.
+inline uint64_t tag_of(uint64_t block) {
+    return block * 0x9E3779B97F4A7C15ull;
+}
+
+class LiveSet {
+public:
+    explicit LiveSet(const stivale2_struct_tag_memmap *mmap)
+        : mmap(mmap) {
+    }
+
+    void add(uint64_t block, uint64_t size) {
+        check(block % size == 0, "block 0x%lx of size 0x%lx is not naturally aligned", block, size);
+        check(fake::is_usable(mmap, mm::virt_to_phys(reinterpret_cast<void *>(block)), size), "block 0x%lx+0x%lx is not usable memory", block, size);
+
+        auto next = blocks.lower_bound(block);
+        check(next == blocks.end() || next->first >= block + size, "block 0x%lx overlaps 0x%lx", block, next->first);
+        if (next != blocks.begin()) {
+            auto prev = std::prev(next);
+            check(prev->first + prev->second <= block, "block 0x%lx overlaps 0x%lx", block, prev->first);
+        }
+
+        blocks[block] = size;
+        write_tags(block, size);
+    }
+
+    void remove(uint64_t block) {
+        auto size = blocks.at(block);
+        auto words = reinterpret_cast<uint64_t *>(block);
+
+        check(words[0] == tag_of(block) && words[size / 8 - 1] == tag_of(block), "block 0x%lx was corrupted while allocated", block);
+        blocks.erase(block);
+    }
+
+    auto random(std::mt19937_64 &rng) const {
+        auto it = blocks.begin();
+        std::advance(it, rng() % blocks.size());
+        return *it;
+    }
+
+    bool empty() const {
+        return blocks.empty();
+    }
+
+    size_t size() const {
+        return blocks.size();
+    }
+
+private:
+    static void write_tags(uint64_t block, uint64_t size) {
+        auto words = reinterpret_cast<uint64_t *>(block);
+        words[0] = words[size / 8 - 1] = tag_of(block);
+    }
+
+    const stivale2_struct_tag_memmap *mmap;
+    std::map<uint64_t, uint64_t> blocks;
+};
+
+// Number of 4KiB pages the buddy manager can hand out. Everything is freed again before returning.
+uint64_t count_free_pages() {
+    std::vector<uint64_t *> pages;
+    while (auto page = buddy.alloc(PAGE_SIZE))
+        pages.push_back(page);
+
+    for (auto page : pages)
+        buddy.free(page);
+
+    return pages.size();
+}
+
+// Pages the physical memory manager has on its freelists and in its caches, after fake::boot_physical().
+uint64_t physical_free_pages() {
+    const auto stats = mm::Physical::stats();
+    return stats.free_pages + stats.cached_pages;
+}
+
+// Free memory according to the per-order free block counters of the zones.
+uint64_t free_bytes() {
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < buddy.zone_count(); i++) {
+        const auto &zone = buddy.zone(i);
+        check(zone.free_pages() * PAGE_SIZE == zone.free_bytes(), "zone %lu counts %lu free pages instead of %lu", i, zone.free_pages(), zone.free_bytes() / PAGE_SIZE);
+        bytes += zone.free_bytes();
+    }
+    check(buddy.free_pages() * PAGE_SIZE == bytes, "buddy manager counts %lu free pages instead of %lu", buddy.free_pages(), bytes / PAGE_SIZE);
+
+    return bytes;
+}
+
+void check_head(uint64_t block, uint64_t size) {
+    auto page = pagelist.virt_to_page(reinterpret_cast<void *>(block));
+    check(page->refcount.load() == 1, "head page of 0x%lx has refcount %d", block, page->refcount.load());
+    check((1ull << (page->order + 3)) == size, "head page of 0x%lx has order %d, expected size 0x%lx", block, page->order, size);
+}
+
+void fuzz_buddy(std::mt19937_64 &rng, uint64_t iterations) {
+    auto mmap = fake::boot();
+    const auto initial_pages = count_free_pages();
+    const auto initial_order = buddy.largest_free_order();
+
+    LiveSet live(mmap);
+    uint64_t failures = 0;
+    PhysicalAddress batch[64];
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        const auto dice = rng() % 100;
+
+        // Every 20th operation goes through the bulk interfaces.
+        if (dice % 20 == 0) {
+            const auto count = 1 + rng() % 64;
+            if (!live.empty() && dice < 30) {
+                uint64_t n = 0;
+                for (; n < count && !live.empty(); n++) {
+                    auto [block, size] = live.random(rng);
+                    check_head(block, size);
+                    live.remove(block);
+                    batch[n] = reinterpret_cast<PhysicalAddress>(block);
+                }
+                buddy.free_bulk(batch, n);
+            } else {
+                const uint64_t size = PAGE_SIZE << (rng() % 6);
+                const auto n = buddy.alloc_bulk(size, batch, count);
+                for (uint64_t j = 0; j < n; j++) {
+                    check_head(reinterpret_cast<uint64_t>(batch[j]), size);
+                    live.add(reinterpret_cast<uint64_t>(batch[j]), size);
+                }
+            }
+            continue;
+        }
+
+        // Bias towards allocating until the allocator runs dry, then towards freeing.
+        if (live.empty() || dice < (failures ? 35 : 55)) {
+            const uint64_t size = PAGE_SIZE << (rng() % 100 < 80 ? rng() % 4 : rng() % 12);
+            auto block = buddy.alloc(size);
+            if (block == nullptr) {
+                failures++;
+                continue;
+            }
+
+            failures = 0;
+            check_head(reinterpret_cast<uint64_t>(block), size);
+            live.add(reinterpret_cast<uint64_t>(block), size);
+        } else {
+            auto [block, size] = live.random(rng);
+            check_head(block, size);
+            live.remove(block);
+            buddy.free(reinterpret_cast<uint64_t *>(block));
+            check(pagelist.virt_to_page(reinterpret_cast<void *>(block))->refcount.load() == 0, "refcount of 0x%lx was not reset by free()", block);
+        }
+    }
+
+    printf("buddy: %lu live blocks after %lu operations\n", live.size(), iterations);
+    while (!live.empty()) {
+        auto [block, size] = live.random(rng);
+        live.remove(block);
+        buddy.free(reinterpret_cast<uint64_t *>(block));
+    }
+
+    // Freeing everything must coalesce the zones back into their initial state.
+    check(buddy.largest_free_order() == initial_order, "largest free order is %d, expected %d", buddy.largest_free_order(), initial_order);
+    check(count_free_pages() == initial_pages, "leaked pages");
+    check(free_bytes() == initial_pages * PAGE_SIZE, "free block counters are off by %ld bytes", free_bytes() - initial_pages * PAGE_SIZE);
+}
+
+// A small zone straddling a large alignment boundary: Its free maps only cover the range, not the window around it,
+// and the buddies of the blocks at its edges lie outside of them. Runs before anything is booted on the fake RAM.
+void fuzz_straddling_zone(std::mt19937_64 &rng, uint64_t iterations) {
+    constexpr uint64_t pages = 48;
+    const uint64_t boundary = fake::direct_map_base + fake::ram_base + fake::ram_size / 2;
+    const uint64_t base = boundary - 16 * PAGE_SIZE, length = pages * PAGE_SIZE;
+
+    // Heap allocated, so that the sanitizer catches accesses past the end of the free maps.
+    std::vector<uint64_t> free_map(BuddyAllocator::free_map_words(base, length));
+    check(free_map.size() < 64, "free maps of a %lu page zone take %lu words", pages, free_map.size());
+
+    BuddyAllocator zone;
+    zone.init(base, length, free_map.data());
+    zone.free_range(base, length);
+
+    std::vector<std::pair<uint64_t *, BuddyAllocator::Order>> live;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (live.empty() || rng() % 2) {
+            const auto order = BuddyAllocator::min_order + static_cast<int>(rng() % 3);
+            auto block = zone.alloc(1ull << (order + 3), FillMode::NONE).unpack();
+            if (block != nullptr)
+                live.push_back({ block, order });
+        } else {
+            std::swap(live[rng() % live.size()], live.back());
+            zone.free(live.back().first, live.back().second);
+            live.pop_back();
+        }
+    }
+
+    for (auto [block, order] : live)
+        zone.free(block, order);
+    check(zone.free_pages() == pages && zone.free_bytes() == length, "zone has %lu free pages, expected %lu", zone.free_pages(), pages);
+}
+
+void fuzz_page_cache(std::mt19937_64 &rng, uint64_t iterations) {
+    auto mmap = fake::boot();
+    const auto initial_pages = count_free_pages();
+
+    static mm::PageCache cache;
+    cache.init(&buddy);
+
+    LiveSet live(mmap);
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (live.empty() || rng() % 2) {
+            const int order = rng() % (mm::PageCache::max_order + 1);
+            auto block = cache.alloc(order);
+            if (block == nullptr)
+                continue;
+
+            live.add(reinterpret_cast<uint64_t>(block), PAGE_SIZE << order);
+        } else {
+            auto [block, size] = live.random(rng);
+            live.remove(block);
+            cache.free(reinterpret_cast<PhysicalAddress>(block), mm::PageCache::order_of(size), rng() % 4 == 0);
+        }
+    }
+
+    while (!live.empty()) {
+        auto [block, size] = live.random(rng);
+        live.remove(block);
+        cache.free(reinterpret_cast<PhysicalAddress>(block), mm::PageCache::order_of(size));
+    }
+
+    for (int order = 0; order <= mm::PageCache::max_order; order++)
+        cache.drain(order, mm::PageCache::high);
+
+    check(count_free_pages() == initial_pages, "page cache leaked pages");
+    printf("page cache: ok\n");
+}
+
+// Runs the early allocator the way boot does: Its region is carved out of the memory map before the
+// pagelist and the buddy manager are set up, afterwards its leftovers are handed to the buddy manager.
+void fuzz_page_frame(std::mt19937_64 &rng, uint64_t iterations) {
+    auto mmap = fake::memory_map();
+
+    constexpr uint64_t early_size = mm::PageFrame::max_pages * PAGE_SIZE;
+    auto entry = &mmap->memmap[1];
+    const PhysicalRange early{ .base = entry->base, .length = early_size };
+    entry->base += early_size;
+    entry->length -= early_size;
+
+    static mm::PageFrame frame;
+    frame.init(reinterpret_cast<PhysicalAddress>(early.base), early.length);
+
+    // Live runs by their first page
+    std::map<uint64_t, uint64_t> live;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (live.empty() || rng() % 100 < 45) {
+            const uint64_t pages = rng() % 4 ? 1 : 1 + rng() % 16;
+            auto run = reinterpret_cast<uint64_t>(frame.allocate_run(pages, FillMode::NONE));
+            if (run == 0)
+                continue;
+
+            const auto length = pages * PAGE_SIZE;
+            check(run % PAGE_SIZE == 0 && run >= early.base && run + length <= early.base + early.length, "bad run 0x%lx", run);
+
+            auto next = live.lower_bound(run);
+            check(next == live.end() || next->first >= run + length, "run 0x%lx overlaps 0x%lx", run, next->first);
+            if (next != live.begin())
+                check(std::prev(next)->first + std::prev(next)->second <= run, "run 0x%lx overlaps 0x%lx", run, std::prev(next)->first);
+
+            live[run] = length;
+        } else {
+            auto it = live.begin();
+            std::advance(it, rng() % live.size());
+            frame.deallocate(reinterpret_cast<PhysicalAddress>(it->first), it->second / PAGE_SIZE);
+            live.erase(it);
+        }
+    }
+
+    uint64_t live_pages = 0;
+    for (auto [run, length] : live)
+        live_pages += length / PAGE_SIZE;
+    check(frame.free_pages() + live_pages == mm::PageFrame::max_pages, "early allocator lost pages");
+
+    // The early zone starts out empty, the leftovers are all it ever gets.
+    fake::boot(mmap, early);
+    const auto pages_before = count_free_pages();
+    const auto leftovers = frame.free_pages();
+
+    frame.release([](uint64_t base, uint64_t length) { buddy.free_range(base, length); });
+    check(frame.free_pages() == 0, "release() kept pages");
+    check(count_free_pages() == pages_before + leftovers, "buddy manager got %lu pages, expected %lu", count_free_pages() - pages_before, leftovers);
+
+    // Nothing the early allocator still has handed out may be allocated again.
+    std::vector<uint64_t *> pages;
+    while (auto page = buddy.alloc(PAGE_SIZE)) {
+        const auto addr = mm::virt_to_phys(page);
+        auto it = live.upper_bound(addr);
+        check(it == live.begin() || std::prev(it)->first + std::prev(it)->second <= addr, "page 0x%lx is still used by the early allocator", addr);
+        pages.push_back(page);
+    }
+
+    for (auto page : pages)
+        buddy.free(page);
+
+    printf("page frame: %lu live pages, %lu pages handed over, ok\n", live_pages, leftovers);
+}
+// Physical::allocate() and friends with the per-CPU page cache and the zero pool in front of the buddy allocators.
+void fuzz_physical(std::mt19937_64 &rng, uint64_t iterations) {
+    using mm::PageCache;
+    namespace Physical = mm::Physical;
+
+    auto mmap = fake::boot_physical();
+    const auto initial_pages = physical_free_pages();
+
+    LiveSet live(mmap);
+    PhysicalAddress batch[64];
+    auto is_zero = [](PhysicalAddress block, uint64_t size) {
+        auto words = static_cast<const uint64_t *>(block);
+        for (uint64_t i = 0; i < size / 8; i++) {
+            if (words[i] != 0)
+                return false;
+        }
+
+        return true;
+    };
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        const auto dice = rng() % 100;
+        const int order = rng() % 100 < 80 ? rng() % (PageCache::max_order + 1) : rng() % 8;
+        const uint64_t size = PAGE_SIZE << order;
+
+        if (dice < 5) {
+            // Pooled pages come back zeroed, the pool is only used for single zero-filled pages.
+            Physical::refill_zero_pool(1 + rng() % 64);
+            const auto pool = Physical::zero_pool_stats();
+            auto page = Physical::allocate(PAGE_SIZE, FillMode::ZERO);
+            if (page == nullptr)
+                continue;
+
+            check(is_zero(page, PAGE_SIZE), "zero pool page %p is not zeroed", page);
+            check(pool.pages == 0 || Physical::zero_pool_stats().hits == pool.hits + 1, "allocation didn't take a pooled page");
+            live.add(reinterpret_cast<uint64_t>(page), PAGE_SIZE);
+        } else if (dice < 10 && !live.empty()) {
+            // nullptr entries are skipped, cached and uncached blocks are routed separately.
+            const auto count = 1 + rng() % 64;
+            uint64_t n = 0;
+            for (; n < count && !live.empty(); n++) {
+                if (rng() % 8 == 0) {
+                    batch[n] = nullptr;
+                    continue;
+                }
+
+                auto [block, block_size] = live.random(rng);
+                check_head(block, block_size);
+                live.remove(block);
+                batch[n] = reinterpret_cast<PhysicalAddress>(block);
+            }
+            Physical::deallocate_bulk(batch, n);
+        } else if (dice < 15) {
+            // Large blocks are split straight into the batch.
+            const auto count = 1 + rng() % 64;
+            const auto fill = rng() % 2 ? FillMode::ZERO : FillMode::NONE;
+            const auto n = Physical::allocate_bulk(batch, count, size, fill);
+            for (uint64_t j = 0; j < n; j++) {
+                check(fill == FillMode::NONE || is_zero(batch[j], size), "bulk block %p is not zeroed", batch[j]);
+                check_head(reinterpret_cast<uint64_t>(batch[j]), size);
+                live.add(reinterpret_cast<uint64_t>(batch[j]), size);
+            }
+        } else if (live.empty() || dice < 60) {
+            const auto fill = rng() % 2 ? FillMode::ZERO : FillMode::NONE;
+            auto block = Physical::allocate(size, fill);
+            if (block == nullptr)
+                continue;
+
+            check(fill == FillMode::NONE || is_zero(block, size), "block %p is not zeroed", block);
+            check_head(reinterpret_cast<uint64_t>(block), size);
+            live.add(reinterpret_cast<uint64_t>(block), size);
+        } else {
+            // Blocks of cached orders go to the page cache (which drains a batch once it is full), the rest to the buddy allocators.
+            auto [block, block_size] = live.random(rng);
+            const auto before = Physical::stats();
+            const auto pages = block_size / PAGE_SIZE;
+
+            live.remove(block);
+            Physical::deallocate(reinterpret_cast<PhysicalAddress>(block));
+
+            const auto after = Physical::stats();
+            check(after.free_pages + after.cached_pages == before.free_pages + before.cached_pages + pages, "deallocate() lost pages");
+            if (PageCache::order_of(block_size) > PageCache::max_order)
+                check(after.cached_pages == before.cached_pages, "block of %lu pages was cached", pages);
+            else
+                check(after.cached_pages == before.cached_pages + pages || after.cached_pages == before.cached_pages + pages - PageCache::batch * pages,
+                      "block of %lu pages bypassed the page cache", pages);
+        }
+    }
+
+    printf("physical: %lu live blocks, %lu zero pool hits\n", live.size(), Physical::zero_pool_stats().hits);
+    while (!live.empty()) {
+        auto [block, size] = live.random(rng);
+        live.remove(block);
+        Physical::deallocate(reinterpret_cast<PhysicalAddress>(block));
+    }
+    check(physical_free_pages() == initial_pages, "leaked pages");
+
+    // A block freed twice is only freed once and can't be handed out twice, whether it goes to the page cache or not.
+    for (const uint64_t size : { PAGE_SIZE, PAGE_SIZE << (PageCache::max_order + 1) }) {
+        auto block = Physical::allocate(size, FillMode::NONE);
+        Physical::deallocate(block);
+        Physical::deallocate(block);
+        check(physical_free_pages() == initial_pages, "double-free of %lu bytes changed the free page count", size);
+
+        auto first = Physical::allocate(size, FillMode::NONE), second = Physical::allocate(size, FillMode::NONE);
+        check(first != second, "double-freed block %p was handed out twice", first);
+        Physical::deallocate(first);
+        Physical::deallocate(second);
+    }
+
+    // Dropping below the low watermark reclaims, but the zero pool is kept. Free memory of all zones counts, the
+    // smallest zones are drained first and fall below the watermark long before the rest.
+    Physical::refill_zero_pool(PageCache::high);
+    const auto pooled = Physical::zero_pool_stats().pages;
+    auto runs = mm::reclaim_stats().runs;
+
+    std::vector<PhysicalAddress> hog;
+    hog.push_back(Physical::allocate(PAGE_SIZE, FillMode::NONE));
+    check(mm::reclaim_stats().runs == runs, "reclaim ran with %lu free pages", Physical::stats().free_pages);
+
+    while (Physical::stats().free_pages > 1)
+        hog.push_back(Physical::allocate_uncached(PAGE_SIZE));
+    hog.push_back(Physical::allocate(PAGE_SIZE, FillMode::NONE));
+    check(mm::reclaim_stats().runs == runs + 1, "dropping below the low watermark ran reclaim %lu times", mm::reclaim_stats().runs - runs);
+    check(Physical::zero_pool_stats().pages == pooled, "watermark reclaim drained the zero pool");
+
+    Physical::deallocate(hog.front());
+    Physical::deallocate(hog.back());
+    for (auto page = hog.begin() + 1; page != hog.end() - 1; page++)
+        Physical::deallocate_uncached(*page);
+
+    // Running out of memory reclaims the page cache and the zero pool before an allocation fails.
+    runs = mm::reclaim_stats().runs;
+    std::vector<PhysicalAddress> pages;
+    while (auto page = Physical::allocate(PAGE_SIZE, FillMode::NONE))
+        pages.push_back(page);
+
+    const auto exhausted = Physical::stats();
+    check(mm::reclaim_stats().runs > runs, "running out of memory didn't reclaim");
+    check(exhausted.free_pages == 0 && exhausted.cached_pages == 0, "%lu free and %lu cached pages left after running out of memory",
+          exhausted.free_pages, exhausted.cached_pages);
+    check(pages.size() == initial_pages, "%lu of %lu pages allocated", pages.size(), initial_pages);
+
+    Physical::deallocate_bulk(pages.data(), pages.size());
+    mm::reclaim(~0ull);
+    check(physical_free_pages() == initial_pages, "leaked pages after running out of memory");
+}
+
+// Objects of random sizes through the size class caches.
+void fuzz_slab(std::mt19937_64 &rng, uint64_t iterations) {
+    fake::boot_physical();
+    const auto initial_pages = physical_free_pages();
+    mm::slab::init();
+
+    // Live objects and their requested size, each is filled with a byte derived from its address.
+    std::map<uint64_t, uint64_t> live;
+    auto fill_of = [](uint64_t object) { return static_cast<uint8_t>(tag_of(object) >> 56); };
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (live.empty() || rng() % 100 < 55) {
+            const uint64_t size = 1 + (rng() % 4 ? rng() % 256 : rng() % mm::slab::max_size);
+            auto object = reinterpret_cast<uint64_t>(mm::slab::allocate(size));
+            if (object == 0)
+                continue;
+
+            auto cache = mm::slab::owner(reinterpret_cast<void *>(object));
+            check(cache != nullptr && cache->stats().object_size >= size, "object 0x%lx of %lu bytes has the wrong owner", object, size);
+
+            auto next = live.lower_bound(object);
+            check(next == live.end() || next->first >= object + size, "object 0x%lx overlaps 0x%lx", object, next->first);
+            if (next != live.begin())
+                check(std::prev(next)->first + std::prev(next)->second <= object, "object 0x%lx overlaps 0x%lx", object, std::prev(next)->first);
+
+            memset(reinterpret_cast<void *>(object), fill_of(object), size);
+            live[object] = size;
+        } else {
+            auto it = live.begin();
+            std::advance(it, rng() % live.size());
+
+            auto bytes = reinterpret_cast<const uint8_t *>(it->first);
+            for (uint64_t j = 0; j < it->second; j++)
+                check(bytes[j] == fill_of(it->first), "object 0x%lx was corrupted at offset %lu", it->first, j);
+
+            mm::slab::deallocate(reinterpret_cast<void *>(it->first));
+            live.erase(it);
+        }
+    }
+
+    uint64_t slabs = 0, cached = 0;
+    for (auto cache = mm::SlabCache::first(); cache; cache = cache->next()) {
+        const auto stats = cache->stats();
+        slabs += stats.partial + stats.full + stats.empty;
+        cached += stats.magazines.cached;
+    }
+    printf("slab: %lu live objects in %lu slabs, %lu objects in magazines\n", live.size(), slabs, cached);
+
+    for (auto [object, size] : live)
+        mm::slab::deallocate(reinterpret_cast<void *>(object));
+
+    // The slab shrinker is registered by slab::init(), reclaiming everything has to leave every cache empty.
+    const auto reclaimed = mm::reclaim_stats().pages;
+    check(mm::reclaim(~0ull) > 0 && mm::reclaim_stats().pages > reclaimed, "reclaim() didn't free any slabs");
+
+    for (auto cache = mm::SlabCache::first(); cache; cache = cache->next()) {
+        check(cache->stats().magazines.cached == 0, "%s still caches objects in magazines", cache->stats().name);
+        check(cache->stats().objects_total == 0, "%s still holds slabs", cache->stats().name);
+    }
+
+    check(physical_free_pages() == initial_pages, "slab caches leaked pages");
+}
+
+// kmalloc() across the slab/page boundary, with and without alignment requirements. Requires fuzz_slab() to have run.
+void fuzz_kmalloc(std::mt19937_64 &rng, uint64_t iterations) {
+    fake::boot_physical();
+    const auto initial_pages = physical_free_pages();
+
+    std::map<uint64_t, uint64_t> live;
+    auto fill_of = [](uint64_t object) { return static_cast<uint8_t>(tag_of(object) >> 56); };
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (live.empty() || rng() % 100 < 55) {
+            const uint64_t size = 1 + (rng() % 32 ? rng() % (2 * mm::slab::max_size) : rng() % (16 * PAGE_SIZE));
+            const uint64_t align = rng() % 4 ? 0 : 1ull << (rng() % 13);
+
+            auto object = reinterpret_cast<uint64_t>(align ? mm::kmalloc_aligned(size, align) : mm::kmalloc(size));
+            if (object == 0)
+                continue;
+
+            check(!align || object % align == 0, "object 0x%lx is not aligned to %lu", object, align);
+            check(mm::kmalloc_usable_size(reinterpret_cast<void *>(object)) >= size, "object 0x%lx is smaller than %lu bytes", object, size);
+
+            auto next = live.lower_bound(object);
+            check(next == live.end() || next->first >= object + size, "object 0x%lx overlaps 0x%lx", object, next->first);
+            if (next != live.begin())
+                check(std::prev(next)->first + std::prev(next)->second <= object, "object 0x%lx overlaps 0x%lx", object, std::prev(next)->first);
+
+            memset(reinterpret_cast<void *>(object), fill_of(object), size);
+            live[object] = size;
+        } else {
+            auto it = live.begin();
+            std::advance(it, rng() % live.size());
+
+            auto bytes = reinterpret_cast<const uint8_t *>(it->first);
+            for (uint64_t j = 0; j < it->second; j++)
+                check(bytes[j] == fill_of(it->first), "object 0x%lx was corrupted at offset %lu", it->first, j);
+
+            mm::kfree(reinterpret_cast<void *>(it->first));
+            live.erase(it);
+        }
+    }
+
+    printf("kmalloc: %lu live objects\n", live.size());
+    for (auto [object, size] : live)
+        mm::kfree(reinterpret_cast<void *>(object));
+
+    for (auto cache = mm::SlabCache::first(); cache; cache = cache->next())
+        cache->shrink();
+
+    check(physical_free_pages() == initial_pages, "kmalloc leaked pages");
+}
+
+// kmalloc() with almost all memory taken: Free memory sits at the low watermark and allocations fail until reclaim
+// frees what the caches hold on to, the shrinkers run in the middle of the slab allocator growing a cache. A shrinker taking a lock held across
+// Physical::allocate() hangs here. Requires fuzz_slab() to have run.
+void fuzz_reclaim(std::mt19937_64 &rng, uint64_t iterations) {
+    fake::boot_physical();
+    const auto initial_pages = physical_free_pages();
+    const auto runs = mm::reclaim_stats().runs;
+
+    // The live objects fit into the pages left over, everything the caches keep around besides them doesn't.
+    // Whatever reclaim gave back to the buddy allocators is taken away again every now and then.
+    constexpr uint64_t spare_pages = 128, max_live = 64;
+    std::vector<PhysicalAddress> hog;
+    auto take_free_pages = [&] {
+        while (mm::Physical::stats().free_pages > spare_pages)
+            hog.push_back(mm::Physical::allocate_uncached(PAGE_SIZE));
+    };
+
+    std::map<uint64_t, uint64_t> live;
+    auto fill_of = [](uint64_t object) { return static_cast<uint8_t>(tag_of(object) >> 56); };
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (i % 64 == 0)
+            take_free_pages();
+
+        if (live.empty() || (live.size() < max_live && rng() % 100 < 60)) {
+            const uint64_t size = 1 + rng() % mm::slab::max_size;
+            auto object = reinterpret_cast<uint64_t>(mm::kmalloc(size));
+            check(object != 0, "kmalloc(%lu) failed with %lu objects live", size, live.size());
+
+            memset(reinterpret_cast<void *>(object), fill_of(object), size);
+            live[object] = size;
+        } else {
+            auto it = live.begin();
+            std::advance(it, rng() % live.size());
+
+            auto bytes = reinterpret_cast<const uint8_t *>(it->first);
+            for (uint64_t j = 0; j < it->second; j++)
+                check(bytes[j] == fill_of(it->first), "object 0x%lx was corrupted at offset %lu", it->first, j);
+
+            mm::kfree(reinterpret_cast<void *>(it->first));
+            live.erase(it);
+        }
+    }
+
+    check(mm::reclaim_stats().runs > runs, "no allocation ran reclaim");
+    printf("reclaim: %lu live objects, %lu runs\n", live.size(), mm::reclaim_stats().runs - runs);
+
+    for (auto [object, size] : live)
+        mm::kfree(reinterpret_cast<void *>(object));
+    for (auto page : hog)
+        mm::Physical::deallocate_uncached(page);
+
+    mm::reclaim(~0ull);
+    check(physical_free_pages() == initial_pages, "slab caches leaked pages under reclaim");
+}
+
+// Small objects with on-slab headers, the constructor leaves a pattern which must survive between uses.
+struct Small {
+    static inline int64_t live;
+
+    uint64_t words[5];
+    Small() {
+        for (auto &word : words)
+            word = 0x5A5A5A5A5A5A5A5Aull;
+        live++;
+    }
+    ~Small() {
+        live--;
+    }
+};
+
+// Page table sized objects with off-slab headers.
+struct alignas(PAGE_SIZE) Table {
+    uint64_t entries[512]{};
+};
+
+void fuzz_object_cache(std::mt19937_64 &rng, uint64_t iterations) {
+    fake::boot_physical();
+    const auto initial_pages = physical_free_pages();
+
+    static_assert(!mm::ObjectCache<Small>::off_slab && mm::ObjectCache<Table>::off_slab);
+    static_assert(mm::ObjectCache<Table>::objects_per_slab >= 8);
+
+    mm::ObjectCache<Small> smalls{ "small" };
+    mm::ObjectCache<Small, false> unconstructed{ "small-unconstructed" };
+    mm::ObjectCache<Table> tables{ "table" };
+
+    std::vector<Small *> live_smalls, live_unconstructed;
+    std::vector<Table *> live_tables;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        const auto kind = rng() % 3;
+        const bool alloc = rng() % 100 < 55;
+
+        if (kind == 0 && (alloc || live_smalls.empty())) {
+            auto object = smalls.allocate();
+            check(object && object->words[0] == 0x5A5A5A5A5A5A5A5Aull && object->words[4] == 0x5A5A5A5A5A5A5A5Aull,
+                  "cached object %p is not in its constructed state", object);
+            object->words[2] = reinterpret_cast<uint64_t>(object);
+            live_smalls.push_back(object);
+        } else if (kind == 0) {
+            const auto j = rng() % live_smalls.size();
+            auto object = live_smalls[j];
+            check(object->words[2] == reinterpret_cast<uint64_t>(object), "object %p was corrupted", object);
+
+            object->words[2] = 0x5A5A5A5A5A5A5A5Aull;
+            smalls.deallocate(object);
+            live_smalls[j] = live_smalls.back();
+            live_smalls.pop_back();
+        } else if (kind == 1 && (alloc || live_unconstructed.empty())) {
+            auto object = unconstructed.allocate();
+            check(object && object->words[1] == 0x5A5A5A5A5A5A5A5Aull, "object %p was not constructed", object);
+            live_unconstructed.push_back(object);
+        } else if (kind == 1) {
+            const auto j = rng() % live_unconstructed.size();
+            unconstructed.deallocate(live_unconstructed[j]);
+            live_unconstructed[j] = live_unconstructed.back();
+            live_unconstructed.pop_back();
+        } else if (alloc || live_tables.empty()) {
+            auto table = tables.allocate();
+            check(table && reinterpret_cast<uint64_t>(table) % PAGE_SIZE == 0, "table %p is not page aligned", table);
+            for (auto entry : table->entries)
+                check(entry == 0, "table %p is not empty", table);
+
+            table->entries[rng() % 512] = reinterpret_cast<uint64_t>(table);
+            live_tables.push_back(table);
+        } else {
+            const auto j = rng() % live_tables.size();
+            auto table = live_tables[j];
+            for (auto &entry : table->entries) {
+                check(entry == 0 || entry == reinterpret_cast<uint64_t>(table), "table %p was corrupted", table);
+                entry = 0;
+            }
+
+            tables.deallocate(table);
+            live_tables[j] = live_tables.back();
+            live_tables.pop_back();
+        }
+    }
+
+    check(smalls.stats().objects_in_use == live_smalls.size() && tables.stats().objects_in_use == live_tables.size(), "object caches miscount objects in use");
+    printf("object cache: %lu small, %lu unconstructed and %lu table objects live, %ld constructed\n", live_smalls.size(),
+           live_unconstructed.size(), live_tables.size(), Small::live);
+
+    for (auto object : live_smalls)
+        smalls.deallocate(object);
+    for (auto object : live_unconstructed)
+        unconstructed.deallocate(object);
+    for (auto table : live_tables) {
+        for (auto &entry : table->entries)
+            entry = 0;
+        tables.deallocate(table);
+    }
+
+    smalls.shrink();
+    unconstructed.shrink();
+    tables.shrink();
+    for (auto cache = mm::SlabCache::first(); cache; cache = cache->next())
+        cache->shrink();
+
+    check(Small::live == 0, "%ld objects were never destroyed", Small::live);
+    check(physical_free_pages() == initial_pages, "object caches leaked pages");
+}
+// The tree behind the vmalloc region: Keys, balance and the aggregated maximum are checked against a std::map.
+struct TreeNode {
+    uint64_t key;
+    uint64_t value;
+    TreeNode *left, *right;
+    int height;
+    uint64_t largest;  // Largest value in the subtree
+};
+
+struct TreeTraits {
+    static uint64_t key(const TreeNode *node) {
+        return node->key;
+    }
+
+    static void update(TreeNode *node) {
+        node->largest = std::max({ node->value, node->left ? node->left->largest : 0, node->right ? node->right->largest : 0 });
+    }
+};
+
+// Height of the subtree, checking order, balance and aggregates on the way.
+int check_subtree(const TreeNode *node, uint64_t min, uint64_t max) {
+    if (node == nullptr)
+        return 0;
+
+    check(node->key >= min && node->key <= max, "key %lu is out of order", node->key);
+    const auto left = check_subtree(node->left, min, node->key - 1), right = check_subtree(node->right, node->key + 1, max);
+    check(std::abs(left - right) <= 1 && node->height == 1 + std::max(left, right), "node %lu is unbalanced (%d/%d)", node->key, left, right);
+    check(node->largest == std::max({ node->value, node->left ? node->left->largest : 0, node->right ? node->right->largest : 0 }), "node %lu has a stale aggregate", node->key);
+
+    return node->height;
+}
+
+void fuzz_avl_tree(std::mt19937_64 &rng, uint64_t iterations) {
+    firefly::libkern::AvlTree<TreeNode, TreeTraits> tree;
+    std::map<uint64_t, TreeNode *> reference;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        const uint64_t key = rng() % 4096;
+
+        if (rng() % 100 < 55) {
+            if (reference.count(key))
+                continue;
+
+            auto node = new TreeNode{ .key = key, .value = rng() % 100000, .left = nullptr, .right = nullptr, .height = 0, .largest = 0 };
+            tree.insert(node);
+            reference[key] = node;
+        } else if (auto it = reference.find(key); it != reference.end()) {
+            tree.remove(it->second);
+            delete it->second;
+            reference.erase(it);
+        }
+
+        auto floor = tree.floor(key), ceil = tree.ceil(key);
+        auto above = reference.lower_bound(key);
+        auto below = above != reference.end() && above->first == key ? above : (above == reference.begin() ? reference.end() : std::prev(above));
+        check(floor == (below == reference.end() ? nullptr : below->second), "floor(%lu) is wrong", key);
+        check(ceil == (above == reference.end() ? nullptr : above->second), "ceil(%lu) is wrong", key);
+        check(tree.find(key) == (reference.count(key) ? reference[key] : nullptr), "find(%lu) is wrong", key);
+
+        if (i % 1024 == 0) {
+            check(tree.size() == reference.size(), "tree holds %lu nodes instead of %lu", tree.size(), reference.size());
+            check_subtree(tree.root(), 0, ~0ull);
+        }
+    }
+
+    printf("avl tree: %lu nodes, height %d\n", tree.size(), tree.root() ? tree.root()->height : 0);
+    for (auto [key, node] : reference) {
+        tree.remove(node);
+        delete node;
+    }
+    check(tree.root() == nullptr && tree.size() == 0, "tree is not empty");
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    const uint64_t seed = argc > 1 ? strtoull(argv[1], nullptr, 0) : 1;
+    const uint64_t iterations = argc > 2 ? strtoull(argv[2], nullptr, 0) : 200000;
+
+    logger::enabled = false;
+    fake::map_memory();
+
+    std::mt19937_64 rng(seed);
+    printf("seed: %lu, iterations: %lu\n", seed, iterations);
+
+    fuzz_straddling_zone(rng, iterations / 10);
+    fuzz_buddy(rng, iterations);
+    fuzz_page_cache(rng, iterations);
+    fuzz_page_frame(rng, iterations / 10);
+    fuzz_physical(rng, iterations / 4);
+    fuzz_slab(rng, iterations);
+    fuzz_kmalloc(rng, iterations / 10);
+    fuzz_reclaim(rng, iterations / 10);
+    fuzz_object_cache(rng, iterations);
+    fuzz_avl_tree(rng, iterations);
+    return 0;
+}